@@ -0,0 +1,517 @@
+/****************************************************************************
+**
+** Copyright (C) 2009 D&R Electronica Weesp B.V. All rights reserved.
+**
+** This file is part of the Axum/MambaNet digital mixing system.
+**
+** This file may be used under the terms of the GNU General Public
+** License version 2.0 as published by the Free Software Foundation
+** and appearing in the file LICENSE.GPL included in the packaging of
+** this file.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+****************************************************************************/
+
+/* MambaNet gateway: bridges the frames of any number of Ethernet, TCP,
+ * UDP and unix socket interfaces (ports). Frames are forwarded as they
+ * were received, straight from the receive buffer of the interface,
+ * without being parsed or re-encoded. The gateway learns on which port
+ * (and connection or hardware address) each node is, so unicast messages
+ * only go where they belong, and drops copies of frames that come back
+ * in over a loop or a second path. Every port also has a node of its own. */
+
+#define _XOPEN_SOURCE 600
+
+#include "mbn.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef MBNP_mingw
+# include <windows.h>
+# define sleep(x) Sleep(x*1000)
+#else
+# include <unistd.h>
+# include <fcntl.h>
+# include <syslog.h>
+#endif
+
+#define MAXPORTS      32
+#define LEARNSIZE   4096 /* power of two */
+#define LEARNPROBES    8
+#define LEARNTIMEOUT 300 /* seconds */
+#define DEDUPSIZE   4096 /* power of two */
+#define DEDUPWINDOW  100 /* milliseconds */
+
+/* MambaNet addresses in the header of a raw frame */
+#define ADDRESS_TO(b) ( \
+    (((unsigned long)(b)[1]<<21) & 0x0FE00000) | (((unsigned long)(b)[2]<<14) & 0x001FC000) | \
+    (((unsigned long)(b)[3]<< 7) & 0x00003F80) | (((unsigned long)(b)[4]    ) & 0x0000007F))
+#define ADDRESS_FROM(b) ( \
+    (((unsigned long)(b)[5]<<21) & 0x0FE00000) | (((unsigned long)(b)[6]<<14) & 0x001FC000) | \
+    (((unsigned long)(b)[7]<< 7) & 0x00003F80) | (((unsigned long)(b)[8]    ) & 0x0000007F))
+
+
+struct gwport {
+  char *spec;
+  struct mbn_node_info node;
+  struct mbn_interface *itf;
+  struct mbn_handler *mbn;
+  /* counters, protected by lock */
+  unsigned long rx, rxbytes, tx, txbytes;
+  unsigned long broadcasts, switched, flooded, duplicates;
+};
+
+/* the port a node was last seen on */
+struct gwlearn {
+  unsigned long addr; /* 0 if unused */
+  int port;
+  unsigned long seen;
+};
+
+/* frame recently forwarded out of a port */
+struct gwdedup {
+  unsigned long hash; /* of the frame and the port */
+  unsigned long seen; /* 0 if unused */
+};
+
+struct gwport port[MAXPORTS];
+int ports = 0;
+struct gwlearn learn[LEARNSIZE];
+struct gwdedup dedup[DEDUPSIZE];
+pthread_mutex_t lock;
+char detached = 0;
+volatile sig_atomic_t stop = 0, report = 0;
+
+struct mbn_node_info gateway_node = {
+  0x00000000, 0x00, /* MambaNet Addr + Services */
+  "MambaNet Gateway",
+  "MambaNet Gateway",
+  0xFFFF, 0x0002, 0x0000,   /* UniqueMediaAccessId, the last one is set per port */
+  0, 0,     /* Hardware revision */
+  0, 0,     /* Firmware revision */
+  0, 0,     /* FPGAFirmware revision */
+  0,        /* NumberOfObjects */
+  0,        /* DefaultEngineAddr */
+  {0,0,0},  /* Hardwareparent */
+  0         /* Service request */
+};
+
+
+void log_message(char *fmt, ...) {
+  char buf[500];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsprintf(buf, fmt, ap);
+  va_end(ap);
+#ifndef MBNP_mingw
+  if(detached) {
+    syslog(LOG_INFO, "%s", buf);
+    return;
+  }
+#endif
+  fprintf(stderr, "%s\n", buf);
+}
+
+
+/* milliseconds since some arbitrary point in time, not affected by
+ * changes to the system clock. Wraps around, so only use differences. */
+unsigned long now_ms() {
+#ifdef MBNP_mingw
+  return (unsigned long)GetTickCount();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+}
+
+
+struct gwport *find_port(struct mbn_handler *mbn) {
+  int i;
+
+  for(i=0; i<ports; i++)
+    if(port[i].mbn == mbn)
+      return &(port[i]);
+  return NULL;
+}
+
+
+/* Remembers where a node is, lock should be locked */
+void learn_node(unsigned long addr, int p, unsigned long now) {
+  struct gwlearn *l, *old = NULL;
+  int i;
+
+  /* nodes without address use 0 */
+  if(addr == 0)
+    return;
+  for(i=0; i<LEARNPROBES; i++) {
+    l = &(learn[(addr+i) & (LEARNSIZE-1)]);
+    if(l->addr == addr || l->addr == 0)
+      break;
+    if(old == NULL || (long)(l->seen-old->seen) < 0)
+      old = l;
+  }
+  /* no room, replace the one we haven't seen for the longest time */
+  if(i == LEARNPROBES)
+    l = old;
+  l->addr = addr;
+  l->port = p;
+  l->seen = now;
+}
+
+
+/* Returns where a node is, or NULL if we don't know. lock should be locked */
+struct gwlearn *find_node(unsigned long addr, unsigned long now) {
+  struct gwlearn *l;
+  int i;
+
+  for(i=0; i<LEARNPROBES && addr != 0; i++) {
+    l = &(learn[(addr+i) & (LEARNSIZE-1)]);
+    if(l->addr == addr)
+      return now-l->seen < LEARNTIMEOUT*1000UL ? l : NULL;
+    if(l->addr == 0)
+      break;
+  }
+  return NULL;
+}
+
+
+/* Returns the cache entry of a frame sent out of port p, and its hash */
+struct gwdedup *dedup_entry(unsigned char *buf, int length, int p, unsigned long *hash) {
+  int i;
+
+  *hash = 2166136261UL;
+  for(i=0; i<length; i++)
+    *hash = ((*hash ^ buf[i]) * 16777619UL) & 0xFFFFFFFFUL;
+  *hash = ((*hash ^ (unsigned long)p) * 16777619UL) & 0xFFFFFFFFUL;
+  return &(dedup[*hash & (DEDUPSIZE-1)]);
+}
+
+
+/* Returns non-zero if a frame that came in on port p was forwarded out of
+ * that same port less than DEDUPWINDOW ago, which means it came back in
+ * over a loop or a second path. A node sending the same message again is
+ * never a duplicate, as its frames come in on its own port and we don't
+ * send them back there. lock should be locked */
+int duplicate_frame(unsigned char *buf, int length, int p, unsigned long now) {
+  unsigned long hash;
+  struct gwdedup *d = dedup_entry(buf, length, p, &hash);
+
+  return d->seen != 0 && d->hash == hash && now-d->seen < DEDUPWINDOW;
+}
+
+
+/* Remembers a frame forwarded out of port p, lock should be locked */
+void forwarded_frame(unsigned char *buf, int length, int p, unsigned long now) {
+  unsigned long hash;
+  struct gwdedup *d = dedup_entry(buf, length, p, &hash);
+
+  d->hash = hash;
+  d->seen = now != 0 ? now : 1;
+}
+
+
+/* Called by the interface of port mbn for every frame, decides where it
+ * goes and forwards it. Returns 0 to let the node of the port process the
+ * frame, which is only needed for broadcasts and messages addressed to it */
+int ReceiveRawMessage(struct mbn_handler *mbn, unsigned char *buf, int length, void *ifaddr) {
+  struct gwport *from = find_port(mbn);
+  struct gwlearn *l;
+  struct mbn_address_node *node;
+  unsigned long to = ADDRESS_TO(buf), now = now_ms();
+  int p, i, target = -1;
+  void *toaddr = NULL;
+
+  if(from == NULL)
+    return 0;
+  p = from-port;
+
+  pthread_mutex_lock(&lock);
+  from->rx++;
+  from->rxbytes += length;
+  if(duplicate_frame(buf, length, p, now)) {
+    from->duplicates++;
+    pthread_mutex_unlock(&lock);
+    return 1;
+  }
+  learn_node(ADDRESS_FROM(buf), p, now);
+
+  if(buf[0] == 0x81)
+    from->broadcasts++;
+  else {
+    /* for the node of a port, stays here */
+    for(i=0; i<ports; i++)
+      if(port[i].mbn->node.MambaNetAddr == to)
+        break;
+    if(i < ports) {
+      pthread_mutex_unlock(&lock);
+      return i == p ? 0 : 1;
+    }
+    if((l = find_node(to, now)) != NULL) {
+      target = l->port;
+      from->switched++;
+    } else
+      from->flooded++;
+  }
+  /* the network of the port itself already took care of it */
+  if(target == p) {
+    pthread_mutex_unlock(&lock);
+    return 1;
+  }
+  for(i=0; i<ports; i++)
+    if(i != p && (target < 0 || target == i)) {
+      port[i].tx++;
+      port[i].txbytes += length;
+      forwarded_frame(buf, length, i, now);
+    }
+  pthread_mutex_unlock(&lock);
+
+  /* the hardware address or connection of the node on the target port is
+   * known to the node of that port, if it isn't the frame goes to all */
+  if(target >= 0 && (node = mbnNodeStatus(port[target].mbn, to)) != NULL)
+    toaddr = node->ifaddr;
+  for(i=0; i<ports; i++)
+    if(i != p && (target < 0 || target == i))
+      mbnSendRawMessage(port[i].mbn, buf, length, toaddr);
+
+  (void)ifaddr;
+  return buf[0] == 0x81 ? 0 : 1;
+}
+
+
+void WriteLogMessage(struct mbn_handler *mbn, char *msg) {
+  struct gwport *p = find_port(mbn);
+
+  log_message("%s: %s", p != NULL ? p->spec : "?", msg);
+}
+
+
+void Error(struct mbn_handler *mbn, int code, char *msg) {
+  struct gwport *p = find_port(mbn);
+
+  log_message("%s: error %d: %s", p != NULL ? p->spec : "?", code, msg);
+}
+
+
+void ConnectionState(struct mbn_handler *mbn, void *ifaddr, int state) {
+  struct gwport *p = find_port(mbn);
+
+  log_message("%s: connection %s", p != NULL ? p->spec : "?",
+    state == MBN_CONNECTION_UP ? "up" : state == MBN_CONNECTION_CONNECTING ? "connecting" : "down");
+  (void)ifaddr;
+}
+
+
+void print_counters() {
+  int i;
+
+  pthread_mutex_lock(&lock);
+  log_message("%-24s %10s %12s %10s %12s %10s %10s %10s %10s", "port",
+    "rx", "rx bytes", "tx", "tx bytes", "broadcast", "switched", "flooded", "duplicate");
+  for(i=0; i<ports; i++)
+    log_message("%-24s %10lu %12lu %10lu %12lu %10lu %10lu %10lu %10lu", port[i].spec,
+      port[i].rx, port[i].rxbytes, port[i].tx, port[i].txbytes,
+      port[i].broadcasts, port[i].switched, port[i].flooded,
+      port[i].duplicates+mbnInterfaceDuplicates(port[i].itf));
+  pthread_mutex_unlock(&lock);
+}
+
+
+/* Splits "host:port" into its parts, either can be empty (NULL) */
+void split_address(char *str, char **host, char **service) {
+  char *c = strrchr(str, ':');
+
+  *host = str;
+  *service = NULL;
+  if(c != NULL) {
+    *c = 0;
+    *service = c[1] ? c+1 : NULL;
+  }
+  if(!**host)
+    *host = NULL;
+}
+
+
+/* Opens the interface of a port from its specification */
+struct mbn_interface *open_port(char *spec, struct mbn_if_config *cfg, char *err) {
+  char *type = strdup(spec), *arg, *host, *service;
+  struct mbn_interface *itf = NULL;
+
+  if((arg = strchr(type, ':')) == NULL) {
+    sprintf(err, "Missing ':' in port");
+    free(type);
+    return NULL;
+  }
+  *(arg++) = 0;
+  sprintf(err, "Unknown or unsupported port type");
+
+#ifdef MBN_IF_ETHERNET
+  if(strcmp(type, "eth") == 0)
+    itf = mbnEthernetOpenConfig(arg, cfg, err);
+#endif
+#ifdef MBN_IF_TCP
+  if(strcmp(type, "tcp") == 0 || strcmp(type, "tcpd") == 0) {
+    split_address(arg, &host, &service);
+    if(strcmp(type, "tcp") == 0)
+      itf = mbnTCPOpenConfig(host, service, NULL, NULL, cfg, err);
+    else
+      itf = mbnTCPOpenConfig(NULL, NULL, host != NULL ? host : "0.0.0.0", service, cfg, err);
+  }
+#endif
+#ifdef MBN_IF_UDP
+  if(strcmp(type, "udp") == 0) {
+    split_address(arg, &host, &service);
+    itf = mbnUDPOpenConfig(host, service, service, cfg, err);
+  }
+#endif
+#ifdef MBN_IF_UNIX
+  if(strcmp(type, "unix") == 0)
+    itf = mbnUnixOpenConfig(arg, NULL, cfg, err);
+  if(strcmp(type, "unixd") == 0)
+    itf = mbnUnixOpenConfig(NULL, arg, cfg, err);
+#endif
+
+  free(type);
+  return itf;
+  host = service = NULL;
+}
+
+
+void usage() {
+  fprintf(stderr, "Usage: gateway [-d] [-s seconds] [-t threads] [-w microseconds] [-u id] port port ...\n");
+  fprintf(stderr, "  -d  detach and run in the background, logging to syslog\n");
+  fprintf(stderr, "  -s  print the port counters every so many seconds\n");
+  fprintf(stderr, "      (they're also printed on SIGUSR1 and when the gateway stops)\n");
+  fprintf(stderr, "  -t  receiver threads of TCP servers\n");
+  fprintf(stderr, "  -w  collect outgoing frames for this long, and send them in batches\n");
+  fprintf(stderr, "  -u  UniqueIDPerProduct of the node of the first port, the others follow\n");
+  fprintf(stderr, "Ports:\n");
+#ifdef MBN_IF_ETHERNET
+  fprintf(stderr, "  eth:<interface>\n");
+#endif
+#ifdef MBN_IF_TCP
+  fprintf(stderr, "  tcp:<host>[:<port>]     connect to a TCP server\n");
+  fprintf(stderr, "  tcpd:[<host>][:<port>]  TCP server\n");
+#endif
+#ifdef MBN_IF_UDP
+  fprintf(stderr, "  udp:[<host>][:<port>]   UDP, with the default remote host\n");
+#endif
+#ifdef MBN_IF_UNIX
+  fprintf(stderr, "  unix:<path>             connect to a unix socket server\n");
+  fprintf(stderr, "  unixd:<path>            unix socket server\n");
+#endif
+  exit(1);
+}
+
+
+void handle_signal(int sig) {
+#ifndef MBNP_mingw
+  if(sig == SIGUSR1) {
+    report = 1;
+    return;
+  }
+#endif
+  stop = 1;
+}
+
+
+int main(int argc, char **argv) {
+  struct mbn_if_config ifcfg;
+  struct mbn_config cfg;
+  char err[MBN_ERRSIZE];
+  int i, interval = 0, elapsed = 0, uid = 1, daemonize = 0;
+
+  memset((void *)&ifcfg, 0, sizeof(struct mbn_if_config));
+  memset((void *)&cfg, 0, sizeof(struct mbn_config));
+  for(i=1; i<argc && argv[i][0] == '-'; i++) {
+    if(strcmp(argv[i], "-d") == 0)
+      daemonize = 1;
+    else if(i+1 < argc && strcmp(argv[i], "-s") == 0)
+      interval = atoi(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-t") == 0)
+      ifcfg.Threads = atoi(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-w") == 0)
+      cfg.TransmitWindow = atoi(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-u") == 0)
+      uid = atoi(argv[++i]);
+    else
+      usage();
+  }
+  if(argc-i < 2 || argc-i > MAXPORTS)
+    usage();
+
+  pthread_mutex_init(&lock, NULL);
+
+  /* open all ports */
+  for(; i<argc; i++) {
+    port[ports].spec = argv[i];
+    if((port[ports].itf = open_port(argv[i], &ifcfg, err)) == NULL) {
+      fprintf(stderr, "%s: %s\n", argv[i], err);
+      return 1;
+    }
+    memcpy((void *)&(port[ports].node), (void *)&gateway_node, sizeof(struct mbn_node_info));
+    port[ports].node.UniqueIDPerProduct = uid+ports;
+    if((port[ports].mbn = mbnInitConfig(&(port[ports].node), NULL, port[ports].itf, &cfg, err)) == NULL) {
+      fprintf(stderr, "%s: %s\n", argv[i], err);
+      return 1;
+    }
+    mbnSetWriteLogMessageCallback(port[ports].mbn, WriteLogMessage);
+    mbnSetErrorCallback(port[ports].mbn, Error);
+    mbnSetConnectionStateCallback(port[ports].mbn, ConnectionState);
+    ports++;
+  }
+
+#ifndef MBNP_mingw
+  if(daemonize) {
+    if(fork() != 0)
+      return 0;
+    setsid();
+    chdir("/");
+    i = open("/dev/null", O_RDWR);
+    dup2(i, 0);
+    dup2(i, 1);
+    dup2(i, 2);
+    openlog("mbn-gateway", LOG_PID, LOG_DAEMON);
+    detached = 1;
+  }
+  signal(SIGUSR1, handle_signal);
+#endif
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  /* all ports are known, start forwarding */
+  for(i=0; i<ports; i++)
+    mbnSetReceiveRawMessageCallback(port[i].mbn, ReceiveRawMessage);
+  for(i=0; i<ports; i++) {
+    mbnStartInterface(port[i].itf, err);
+    log_message("%s: started", port[i].spec);
+  }
+
+  while(!stop) {
+    sleep(1);
+    if(report || (interval > 0 && ++elapsed >= interval)) {
+      print_counters();
+      report = elapsed = 0;
+    }
+  }
+
+  print_counters();
+  /* stop receiving on all ports before any of them is freed */
+  for(i=0; i<ports; i++)
+    mbnUnsetReceiveRawMessageCallback(port[i].mbn);
+  for(i=0; i<ports; i++)
+    mbnFree(port[i].mbn);
+  pthread_mutex_destroy(&lock);
+  return 0;
+}
+
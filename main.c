@@ -140,10 +140,16 @@ int main(void) {
   }
   mbnEthernetIFFree(ifl);
 
-  if (mbnEthernetMIILinkStatus(itf, err))
-    fprintf(stdout, "Link up\n");
-  else
-    fprintf(stdout, "Link down\n");
+  switch (mbnEthernetMIILinkStatus(itf, err)) {
+    case 1:
+      fprintf(stdout, "Link up\n");
+      break;
+    case 0:
+      fprintf(stdout, "Link down\n");
+      break;
+    default:
+      fprintf(stdout, "Link status unknown: %s\n", err);
+  }
 #endif
 
   objects[0] = MBN_OBJ("Object #1", MBN_DATATYPE_UINT, 0, 2, 0, 512, 256, MBN_DATATYPE_NODATA);
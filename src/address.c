@@ -14,46 +14,110 @@
 **
 ****************************************************************************/
 
+#define _XOPEN_SOURCE 600
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <pthread.h>
 
 #include "mbn.h"
 #include "address.h"
 
-/* sleep() */
 #ifdef MBNP_mingw
 # include <windows.h>
-# define sleep(x) Sleep(x*1000)
 #else
 # include <unistd.h>
+# include <sys/select.h>
+# include <sys/time.h>
 #endif
 
 
 void init_addresses(struct mbn_handler *mbn) {
   mbn->addrsize = 32;
   mbn->addresses = calloc(mbn->addrsize, sizeof(struct mbn_address_node));
+
+  /* seed our random generator with something unique to this node, so that
+   * nodes running the same firmware don't pick the same random timings */
+  mbn->random  = ((unsigned long)mbn->node.ManufacturerID<<16) | mbn->node.ProductID;
+  mbn->random ^= ((unsigned long)mbn->node.UniqueIDPerProduct<<8) ^ (unsigned long)time(NULL) ^ (unsigned long)mbn;
 }
 
 
-void remove_node(struct mbn_handler *mbn, struct mbn_address_node *node) {
+/* milliseconds since some arbitrary point in time, not affected by
+ * changes to the system clock. Wraps around, so only use differences. */
+unsigned long monotonic_ms() {
+#ifdef MBNP_mingw
+  return (unsigned long)GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+}
+
+
+/* simple linear congruential generator, returns a number between 0 and 32767 */
+int address_random(struct mbn_handler *mbn) {
+  mbn->random = mbn->random*1103515245 + 12345;
+  return (int)((mbn->random>>16) & 0x7FFF);
+}
+
+
+/* Returns the window (in milliseconds) in which our address reservation
+ * information packets are randomly spread. The window grows with the number
+ * of nodes we know of, so the total packet rate on large networks stays
+ * about the same, but never exceeds max. */
+int info_spread(struct mbn_handler *mbn, int max) {
+  int i, spread = MBN_ADDR_MSG_JITTER;
+
+  for(i=0; i<mbn->addrsize; i++)
+    if(mbn->addresses[i].used)
+      spread += MBN_ADDR_MSG_SPREAD;
+  return spread > max ? max : spread;
+}
+
+
+/* Returns nonzero if ifaddr is used in the address table of mbn */
+int ifaddr_used(struct mbn_handler *mbn, void *ifaddr) {
   int i;
+  for(i=0; i<mbn->addrsize; i++)
+    if(mbn->addresses[i].used && mbn->addresses[i].ifaddr == ifaddr)
+      return 1;
+  return 0;
+}
+
+
+/* Frees the ifaddr pointer when it isn't used anymore by any node
+ * in the address table of mbn or of the other nodes sharing the interface.
+ * The caller holds GLCK(), the tables of the other nodes are read without
+ * their lock, which is fine as only the table of mbn can lose the pointer. */
+void release_ifaddr(struct mbn_handler *mbn, void *ifaddr) {
+  struct mbn_handler *m;
+  int used;
+
+  if(ifaddr == NULL || mbn->itf->cb_free_addr == NULL)
+    return;
+
+  used = ifaddr_used(mbn, ifaddr);
+  for(m=mbn->itf->mbn; !used && m!=NULL; m=m->next)
+    if(m != mbn)
+      used = ifaddr_used(m, ifaddr);
+  if(!used)
+    mbn->itf->cb_free_addr(mbn->itf, ifaddr);
+}
 
+
+void remove_node(struct mbn_handler *mbn, struct mbn_address_node *node) {
   /* send callback */
   if(mbn->cb_AddressTableChange != NULL)
     mbn->cb_AddressTableChange(mbn, node, NULL);
 
   /* remove node (and free the ifaddr pointer) */
   node->used = 0;
-  if(node->ifaddr != 0 && mbn->itf->cb_free_addr != NULL) {
-    for(i=0; i<mbn->addrsize; i++)
-      if(mbn->addresses[i].used && &(mbn->addresses[i]) != node && mbn->addresses[i].ifaddr == node->ifaddr)
-        break;
-    if(i >= mbn->addrsize)
-      mbn->itf->cb_free_addr(mbn->itf, node->ifaddr);
-  }
+  release_ifaddr(mbn, node->ifaddr);
 }
 
 
@@ -92,16 +156,13 @@ struct mbn_address_node * MBN_EXPORT mbnNextNode(struct mbn_handler *mbn, struct
 
 /* free()'s the entire address list */
 void free_addresses(struct mbn_handler *mbn) {
-  int i, j;
+  int i;
 
   /* free all ifaddr pointers */
   for(i=0; i<mbn->addrsize; i++)
-    if(mbn->addresses[i].used && mbn->addresses[i].ifaddr != NULL) {
-      for(j=i+1; j<mbn->addrsize; j++)
-        if(mbn->addresses[j].used && mbn->addresses[j].ifaddr == mbn->addresses[i].ifaddr)
-          break;
-      if(j >= mbn->addrsize)
-        mbn->itf->cb_free_addr(mbn->itf, mbn->addresses[i].ifaddr);
+    if(mbn->addresses[i].used) {
+      mbn->addresses[i].used = 0;
+      release_ifaddr(mbn, mbn->addresses[i].ifaddr);
     }
   /* free the array */
   free(mbn->addresses);
@@ -110,9 +171,27 @@ void free_addresses(struct mbn_handler *mbn) {
 }
 
 
+/* Mark a node as alive, it'll time out if we don't hear from
+ * it again within the timeout for its type of node */
+void refresh_node(struct mbn_handler *mbn, struct mbn_address_node *node) {
+  int timeout;
+
+  if(!(node->Services & MBN_ADDR_SERVICES_ENGINE))
+    timeout = mbn->config.AddressTimeout*1000;
+  else if(mbn->hbtimeout > 0)
+    timeout = mbn->hbtimeout;
+  else
+    timeout = mbn->config.EngineAddressTimeout*1000;
+  node->LastSeen = monotonic_ms();
+  node->Alive = node->LastSeen + timeout;
+}
+
+
 /* send an address reservation broadcast message */
 void send_info(struct mbn_handler *mbn) {
   struct mbn_message msg;
+  int interval, spread;
+
   memset((void *)&msg, 0, sizeof(struct mbn_message));
   msg.AddressTo   = MBN_BROADCAST_ADDRESS;
   msg.AddressFrom = mbn->node.MambaNetAddr;
@@ -126,41 +205,185 @@ void send_info(struct mbn_handler *mbn) {
   msg.Message.Address.EngineAddr         = mbn->node.DefaultEngineAddr;
   msg.Message.Address.Services           = mbn->node.Services;
   mbnSendMessage(mbn, &msg, MBN_SEND_IGNOREVALID);
+  mbn->lastinfo = monotonic_ms();
+
+  /* schedule the next message, somewhere within the spread window around the interval */
+  if(!(mbn->node.Services & MBN_ADDR_SERVICES_VALID) && mbn->joinretry > 0) {
+    /* fast join: retry quickly, backing off exponentially */
+    interval = mbn->joinretry;
+    mbn->joinretry *= 2;
+    if(mbn->joinretry >= 1000)
+      mbn->joinretry = 0;
+  } else if(!(mbn->node.Services & MBN_ADDR_SERVICES_VALID))
+    interval = 1000;
+  else if((mbn->node.Services & MBN_ADDR_SERVICES_ENGINE) && mbn->hbinterval > 0)
+    interval = mbn->hbinterval;
+  else if(mbn->node.Services & MBN_ADDR_SERVICES_ENGINE)
+    interval = mbn->config.EngineAddressMsgTimeout*1000;
+  else
+    interval = mbn->config.AddressMsgTimeout*1000;
+  spread = info_spread(mbn, interval/2);
+  mbn->pongtimeout = interval - spread/2 + address_random(mbn)%(spread+1);
+}
+
+
+/* Called when our interface is ready to send and receive messages.
+ * Instead of waiting for the timeout thread to announce us, send our
+ * address reservation information right away and retry quickly until
+ * we get a validated address. */
+void start_join(struct mbn_handler *mbn) {
+  mbn->joinstart = monotonic_ms();
+  mbn->joining = 1;
+  mbn->joinretry = MBN_ADDR_JOIN_RETRY;
+  send_info(mbn);
+}
+
+
+/* Answer a ping some random time from now, used for broadcasted
+ * ping requests, which would otherwise be answered by all nodes at once */
+void defer_info(struct mbn_handler *mbn) {
+  int t = address_random(mbn)%(info_spread(mbn, mbn->config.EngineAddressTimeout*1000/2)+1);
+  if(t < mbn->pongtimeout)
+    mbn->pongtimeout = t;
+}
+
+
+/* Answer a directed ping as soon as possible. Nodes in heartbeat mode
+ * ping their engine at a high rate, so don't send more than one
+ * information packet every MBN_ADDR_MSG_MIN milliseconds. */
+void reply_info(struct mbn_handler *mbn) {
+  int t = (int)(monotonic_ms()-mbn->lastinfo);
+
+  if(t >= MBN_ADDR_MSG_MIN)
+    send_info(mbn);
+  else if(MBN_ADDR_MSG_MIN-t < mbn->pongtimeout)
+    mbn->pongtimeout = MBN_ADDR_MSG_MIN-t;
+}
 
-  if (mbn->node.Services & MBN_ADDR_SERVICES_ENGINE) {
-    mbn->pongtimeout = MBN_ENG_ADDR_MSG_TIMEOUT;
-  } else {
-    mbn->pongtimeout = MBN_ADDR_MSG_TIMEOUT;
+
+/* Engines can limit the number of address reservation information packets
+ * they process per second. When the limit has been reached, packets that
+ * don't tell us anything new are only used to keep the node alive.
+ * Returns nonzero if the message shouldn't be processed any further. */
+int limit_address_info(struct mbn_handler *mbn, struct mbn_message *msg, void *ifaddr) {
+  struct mbn_message_address *nfo = &(msg->Message.Address);
+  struct mbn_address_node *node;
+
+  if(mbn->infolimit <= 0 || msg->MessageType != MBN_MSGTYPE_ADDRESS || nfo->Action != MBN_ADDR_ACTION_INFO)
+    return 0;
+  if(mbn->infotokens > 0) {
+    mbn->infotokens--;
+    return 0;
   }
+
+  node = mbnNodeStatus(mbn, nfo->MambaNetAddr);
+  if(node == NULL || !(nfo->Services & MBN_ADDR_SERVICES_VALID) || node->ifaddr != ifaddr ||
+      node->ManufacturerID != nfo->ManufacturerID || node->ProductID != nfo->ProductID ||
+      node->UniqueIDPerProduct != nfo->UniqueIDPerProduct || node->EngineAddr != nfo->EngineAddr ||
+      node->Services != nfo->Services)
+    return 0;
+
+  refresh_node(mbn, node);
+  mbn->infodropped++;
+  return 1;
 }
 
 
-/* Thread waiting for timeouts */
-void *node_timeout_thread(void *arg) {
-  struct mbn_handler *mbn = (struct mbn_handler *) arg;
-  int i;
+/* Returns the number of milliseconds the timeout thread may sleep for this node */
+int node_wait(struct mbn_handler *mbn) {
+  /* wake up earlier when the next information packet or heartbeat is due */
+  int wait = mbn->pongtimeout < MBN_ADDR_TICK ? mbn->pongtimeout : MBN_ADDR_TICK;
+  if(mbn->hbinterval > 0 && mbn->hbping < wait)
+    wait = mbn->hbping;
+  if(mbn->hbtimeout > 0 && mbn->hbtimeout/4 < wait)
+    wait = mbn->hbtimeout/4;
+  return wait;
+}
 
-  mbn->timeout_run = 1;
 
-  while(1) {
-    sleep(1);
-    pthread_testcancel();
+/* Handles the timeouts of a single node, refill is set once every second */
+void node_timeouts(struct mbn_handler *mbn, unsigned long now, int elapsed, int refill) {
+  struct mbn_address_node *node;
+  int i;
 
-    /* check the address list */
-    for(i=0; i<mbn->addrsize; i++) {
-      if(!mbn->addresses[i].used)
-        continue;
+  PLCK();
+  /* check the address list */
+  for(i=0; i<mbn->addrsize; i++) {
+    node = &(mbn->addresses[i]);
+    if(!node->used || (long)(now-node->Alive) < 0)
+      continue;
 
-      if(--mbn->addresses[i].Alive > 0)
-        continue;
+    /* if we're here, it means this node timed out - remove it */
+    node->Latency = (int)(now-node->LastSeen);
+    mbnWriteLogMessage(mbn->itf, "Node %08lX timed out, last seen %d ms ago", node->MambaNetAddr, node->Latency);
+    remove_node(mbn, node);
+  }
 
-      /* if we're here, it means this node timed out - remove it */
-      remove_node(mbn, &(mbn->addresses[i]));
+  if(refill)
+    mbn->infotokens = mbn->infolimit;
+
+  /* heartbeat mode: ask our engines to tell us they're still alive */
+  if(mbn->hbinterval > 0 && (mbn->hbping -= elapsed) <= 0) {
+    mbn->hbping = mbn->hbinterval;
+    if(!(mbn->node.Services & MBN_ADDR_SERVICES_ENGINE)) {
+      for(i=0; i<mbn->addrsize; i++)
+        if(mbn->addresses[i].used && (mbn->addresses[i].Services & MBN_ADDR_SERVICES_ENGINE))
+          mbnSendPingRequest(mbn, mbn->addresses[i].MambaNetAddr);
     }
+  }
+
+  /* send address reservation information messages, if needed */
+  if((mbn->pongtimeout -= elapsed) <= 0)
+    send_info(mbn);
+  PULCK();
+}
+
+
+/* Thread waiting for timeouts, shared by all nodes on the interface */
+void *node_timeout_thread(void *arg) {
+  struct mbn_handler *mbn = (struct mbn_handler *) arg, *m;
+#ifndef MBNP_mingw
+  struct timeval tv;
+#endif
+  unsigned long last, now;
+  int i, wait, elapsed, refill, second = 0;
+
+  mbn->timeout_run = 1;
+  last = monotonic_ms();
 
-    /* send address reservation information messages, if needed */
-    if(!(mbn->node.Services & MBN_ADDR_SERVICES_VALID) || --mbn->pongtimeout <= 0)
-      send_info(mbn);
+  while(1) {
+    wait = MBN_ADDR_TICK;
+    GLCK();
+    for(m=mbn; m!=NULL; m=m->next)
+      if((i = node_wait(m)) < wait)
+        wait = i;
+    GULCK();
+    if(wait < 1)
+      wait = 1;
+#ifdef MBNP_mingw
+    Sleep(wait);
+#else
+    tv.tv_sec = 0;
+    tv.tv_usec = wait*1000;
+    select(0, NULL, NULL, NULL, &tv);
+#endif
+    pthread_testcancel();
+
+    now = monotonic_ms();
+    elapsed = (int)(now-last);
+    last = now;
+    if((refill = (second += elapsed) >= 1000))
+      second -= 1000;
+
+    /* don't get cancelled while holding the lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &i);
+    GLCK();
+    mbnStartBatch(mbn);
+    for(m=mbn; m!=NULL; m=m->next)
+      node_timeouts(m, now, elapsed, refill);
+    mbnFlushBatch(mbn);
+    GULCK();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &i);
   }
 }
 
@@ -169,6 +392,7 @@ void *node_timeout_thread(void *arg) {
  * the internal address list */
 void process_reservation_information(struct mbn_handler *mbn, struct mbn_message_address *nfo, void *ifaddr) {
   struct mbn_address_node *node, new;
+  void *old;
   int i;
 
   /* look for existing node with this address */
@@ -222,27 +446,22 @@ void process_reservation_information(struct mbn_handler *mbn, struct mbn_message
         mbn->cb_AddressTableChange(mbn, node->MambaNetAddr == 0 ? NULL : node, &new);
       memcpy((void *)node, (void *)&new, sizeof(struct mbn_address_node));
     }
-    if (new.Services&MBN_ADDR_SERVICES_ENGINE) {
-      node->Alive = MBN_ENG_ADDR_TIMEOUT;
-    } else {
-      node->Alive = MBN_ADDR_TIMEOUT;
-    }
+    refresh_node(mbn, node);
     /* update hardware address */
-    if(node->ifaddr != NULL && ifaddr != node->ifaddr && mbn->itf->cb_free_addr != NULL) {
-      /* check for nodes with the same pointer, and free the memory if none found */
-      for(i=0; i<mbn->addrsize; i++)
-        if(mbn->addresses[i].used && mbn->addresses[i].ifaddr == node->ifaddr)
-          break;
-      if(i >= mbn->addrsize)
-        mbn->itf->cb_free_addr(mbn->itf, node->ifaddr);
+    if(node->ifaddr != ifaddr) {
+      /* free the old pointer if no other node uses it */
+      old = node->ifaddr;
+      node->ifaddr = ifaddr;
+      release_ifaddr(mbn, old);
     }
-    node->ifaddr = ifaddr;
   }
 }
 
 
 /* Returns nonzero if the message has been processed */
 int process_address_message(struct mbn_handler *mbn, struct mbn_message *msg, void *ifaddr) {
+  unsigned char valid;
+
   if(msg->MessageType != MBN_MSGTYPE_ADDRESS)
     return 0;
 
@@ -253,13 +472,18 @@ int process_address_message(struct mbn_handler *mbn, struct mbn_message *msg, vo
 
     case MBN_ADDR_ACTION_RESPONSE:
       if(MBN_ADDR_EQ(&(msg->Message.Address), &(mbn->node))) {
-        /* check for mambanet address/valid bit change */
-        if(mbn->node.MambaNetAddr != msg->Message.Address.MambaNetAddr) {
+        /* check for mambanet address/valid bit change
+         * (a node may already know the address it's going to get) */
+        valid = msg->Message.Address.Services & MBN_ADDR_SERVICES_VALID && msg->Message.Address.MambaNetAddr > 0 ? MBN_ADDR_SERVICES_VALID : 0;
+        if(mbn->node.MambaNetAddr != msg->Message.Address.MambaNetAddr || (mbn->node.Services & MBN_ADDR_SERVICES_VALID) != valid) {
           mbn->node.MambaNetAddr = msg->Message.Address.MambaNetAddr;
-          if(msg->Message.Address.Services & MBN_ADDR_SERVICES_VALID && mbn->node.MambaNetAddr > 0)
-            mbn->node.Services |= MBN_ADDR_SERVICES_VALID;
-          else
-            mbn->node.Services &= ~MBN_ADDR_SERVICES_VALID;
+          mbn->node.Services = (mbn->node.Services & ~MBN_ADDR_SERVICES_VALID) | valid;
+          if(valid && mbn->joining) {
+            mbn->joining = 0;
+            mbn->joinretry = 0;
+            mbn->jointime = (int)(monotonic_ms()-mbn->joinstart);
+            mbnWriteLogMessage(mbn->itf, "Got validated MambaNet address %08lX in %d ms", mbn->node.MambaNetAddr, mbn->jointime);
+          }
           if(mbn->cb_OnlineStatus != NULL)
             mbn->cb_OnlineStatus(mbn, mbn->node.MambaNetAddr, mbn->node.Services & MBN_ADDR_SERVICES_VALID ? 1 : 0);
         }
@@ -278,7 +502,10 @@ int process_address_message(struct mbn_handler *mbn, struct mbn_message *msg, vo
       if(MBN_ADDR_EQ(&(msg->Message.Address), &(mbn->node)) &&
           (msg->Message.Address.MambaNetAddr == 0 || msg->Message.Address.MambaNetAddr == mbn->node.MambaNetAddr) &&
           (msg->Message.Address.EngineAddr   == 0 || msg->Message.Address.EngineAddr   == mbn->node.DefaultEngineAddr)) {
-        send_info(mbn);
+        if(msg->AddressTo == MBN_BROADCAST_ADDRESS)
+          defer_info(mbn);
+        else
+          reply_info(mbn);
       }
       break;
 
@@ -309,3 +536,24 @@ void MBN_EXPORT mbnForceAddress(struct mbn_handler *mbn, unsigned long addr) {
 }
 
 
+/* Limit the number of address reservation information
+ * packets processed per second, 0 to disable */
+void MBN_EXPORT mbnSetAddressInfoLimit(struct mbn_handler *mbn, int limit) {
+  mbn->infolimit = limit;
+  mbn->infotokens = limit;
+}
+
+
+/* Enable heartbeat mode: ping our engines every interval milliseconds,
+ * and consider them dead after timeout milliseconds of silence.
+ * Engines will send their information packets every interval
+ * milliseconds instead. An interval of 0 disables heartbeat mode. */
+void MBN_EXPORT mbnSetHeartbeat(struct mbn_handler *mbn, int interval, int timeout) {
+  if(interval <= 0)
+    interval = timeout = 0;
+  else if(timeout <= interval)
+    timeout = interval*3;
+  mbn->hbinterval = interval;
+  mbn->hbtimeout = timeout;
+  mbn->hbping = interval;
+}
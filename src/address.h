@@ -20,8 +20,12 @@
 #include "mbn.h"
 
 void init_addresses(struct mbn_handler *);
+unsigned long monotonic_ms();
+void send_info(struct mbn_handler *);
+void start_join(struct mbn_handler *);
 void *node_timeout_thread(void *);
 int process_address_message(struct mbn_handler *, struct mbn_message *, void *);
+int limit_address_info(struct mbn_handler *, struct mbn_message *, void *);
 void free_addresses(struct mbn_handler *);
 
 #endif
@@ -19,6 +19,7 @@
 
 #include "mbn.h"
 
+int convert_7to8bits(unsigned char *, unsigned char, unsigned char *);
 int parse_message(struct mbn_message *);
 void free_message(struct mbn_message *);
 void free_datatype(unsigned char, union mbn_data *);
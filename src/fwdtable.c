@@ -0,0 +1,266 @@
+/****************************************************************************
+**
+** Copyright (C) 2009 D&R Electronica Weesp B.V. All rights reserved.
+**
+** This file is part of the Axum/MambaNet digital mixing system.
+**
+** This file may be used under the terms of the GNU General Public
+** License version 2.0 as published by the Free Software Foundation
+** and appearing in the file LICENSE.GPL included in the packaging of
+** this file.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbn.h"
+#include "fwdtable.h"
+#include "address.h"
+
+/* spread the bits of an address over the buckets */
+#define FWD_HASH(t, a) (((a) ^ ((a)>>9) ^ ((a)>>18)) & ((t)->buckets-1))
+
+
+/* Allocates a table for size addresses, entries not seen for
+ * timeout seconds are ignored. A size of 0 disables the table,
+ * nothing is learned and all lookups fail. */
+void fwd_init(struct fwd_table *t, int size, int timeout) {
+  int i;
+
+  memset((void *)t, 0, sizeof(struct fwd_table));
+  pthread_mutex_init(&(t->lock), NULL);
+  t->timeout = (unsigned long)timeout*1000;
+  t->free = -1;
+  if(size <= 0)
+    return;
+
+  t->size = size;
+  for(t->buckets=16; t->buckets < size; t->buckets *= 2)
+    ;
+  t->entry = (struct fwd_entry *)calloc(size, sizeof(struct fwd_entry));
+  t->bucket = (int *)malloc(t->buckets*sizeof(int));
+  for(i=0; i<t->buckets; i++)
+    t->bucket[i] = -1;
+  for(i=0; i<size; i++)
+    t->entry[i].next = i+1 < size ? i+1 : -1;
+  t->free = 0;
+}
+
+
+void fwd_free(struct fwd_table *t) {
+  if(t->entry != NULL)
+    free(t->entry);
+  if(t->bucket != NULL)
+    free(t->bucket);
+  t->entry = NULL;
+  t->bucket = NULL;
+  t->size = t->count = 0;
+  pthread_mutex_destroy(&(t->lock));
+}
+
+
+/* Returns the index of the entry for addr, or -1. t->lock should be locked */
+int fwd_find(struct fwd_table *t, unsigned long addr) {
+  int i;
+
+  for(i=t->bucket[FWD_HASH(t, addr)]; i >= 0; i=t->entry[i].next)
+    if(t->entry[i].addr == addr)
+      return i;
+  return -1;
+}
+
+
+/* Removes the entries of a port, or the entries that have
+ * timed out when port is NULL. t->lock should be locked */
+void fwd_purge(struct fwd_table *t, void *port, unsigned long now) {
+  int b, i, *p;
+
+  for(b=0; b<t->buckets; b++) {
+    p = &(t->bucket[b]);
+    while((i = *p) >= 0) {
+      if(port != NULL ? t->entry[i].port == port : now-t->entry[i].seen >= t->timeout) {
+        *p = t->entry[i].next;
+        t->entry[i].next = t->free;
+        t->free = i;
+        t->count--;
+      } else
+        p = &(t->entry[i].next);
+    }
+  }
+}
+
+
+/* Remembers that addr was seen on port, a node that moves to
+ * another connection is simply updated. When the table is full the
+ * timed out entries are removed, if there are none the address isn't
+ * learned and traffic for it is flooded. */
+void fwd_learn(struct fwd_table *t, unsigned long addr, void *port) {
+  unsigned long now;
+  int i;
+
+  /* nodes without address use 0 */
+  if(t->size == 0 || addr == 0)
+    return;
+
+  now = monotonic_ms();
+  pthread_mutex_lock(&(t->lock));
+  if((i = fwd_find(t, addr)) < 0) {
+    if(t->free < 0)
+      fwd_purge(t, NULL, now);
+    if((i = t->free) < 0) {
+      pthread_mutex_unlock(&(t->lock));
+      return;
+    }
+    t->free = t->entry[i].next;
+    t->entry[i].addr = addr;
+    t->entry[i].next = t->bucket[FWD_HASH(t, addr)];
+    t->bucket[FWD_HASH(t, addr)] = i;
+    t->count++;
+  }
+  t->entry[i].port = port;
+  t->entry[i].seen = now;
+  pthread_mutex_unlock(&(t->lock));
+}
+
+
+/* Returns the port addr was last seen on, or NULL if it
+ * isn't known (anymore) */
+void *fwd_lookup(struct fwd_table *t, unsigned long addr) {
+  void *port = NULL;
+  int i;
+
+  if(t->size == 0 || addr == 0)
+    return NULL;
+
+  pthread_mutex_lock(&(t->lock));
+  if((i = fwd_find(t, addr)) >= 0 && monotonic_ms()-t->entry[i].seen < t->timeout)
+    port = t->entry[i].port;
+  pthread_mutex_unlock(&(t->lock));
+  return port;
+}
+
+
+/* Forgets all addresses of a port, called when the connection is closed */
+void fwd_forget(struct fwd_table *t, void *port) {
+  if(t->size == 0)
+    return;
+
+  pthread_mutex_lock(&(t->lock));
+  fwd_purge(t, port, 0);
+  pthread_mutex_unlock(&(t->lock));
+}
+
+/* Sets up the broadcast cache, a window of 0 (or less) disables it */
+void fwd_dedup_init(struct fwd_dedup *d, int window) {
+  memset((void *)d, 0, sizeof(struct fwd_dedup));
+  pthread_mutex_init(&(d->lock), NULL);
+  d->window = window > 0 ? window : 0;
+}
+
+
+void fwd_dedup_free(struct fwd_dedup *d) {
+  pthread_mutex_destroy(&(d->lock));
+}
+
+
+/* Returns the cache entry of a broadcast and its hash in *hash */
+int fwd_dedup_entry(unsigned char *buf, int length, unsigned long *hash) {
+  int i;
+
+  /* FNV-1a over everything from AddressFrom up to the end byte */
+  *hash = 2166136261UL;
+  for(i=5; i<length-1; i++)
+    *hash = ((*hash ^ buf[i]) * 16777619UL) & 0xFFFFFFFFUL;
+  return *hash & (FWD_DEDUPSIZE-1);
+}
+
+
+/* Returns non-zero if the same broadcast came in on an other port (or
+ * was sent by our own nodes) less than d->window milliseconds ago. As it
+ * has been forwarded to all other ports, it came back over a loop and is
+ * counted in itf->duplicates. Otherwise it is remembered with the port it
+ * came in on; a node on that port may send the same message again at any
+ * time, like a fader that goes back to where it was or an info message
+ * repeated in heartbeat mode. */
+int fwd_duplicate(struct mbn_interface *itf, struct fwd_dedup *d, unsigned char *buf, int length, void *port) {
+  unsigned long hash, now;
+  int i, dup;
+
+  if(d->window == 0 || length < 14)
+    return 0;
+
+  i = fwd_dedup_entry(buf, length, &hash);
+  now = monotonic_ms();
+  pthread_mutex_lock(&(d->lock));
+  dup = d->entry[i].seen != 0 && d->entry[i].hash == hash && d->entry[i].port != port
+    && now-d->entry[i].seen < d->window;
+  if(dup)
+    itf->duplicates++;
+  else {
+    d->entry[i].hash = hash;
+    d->entry[i].port = port;
+    /* 0 marks an unused entry */
+    d->entry[i].seen = now != 0 ? now : 1;
+  }
+  pthread_mutex_unlock(&(d->lock));
+
+  if(dup && itf->duplicates == 1)
+    mbnWriteLogMessage(itf, "Dropped a duplicate broadcast, is there a loop in the network?");
+  return dup;
+}
+
+
+/* Remembers a broadcast sent by our own nodes, so it is dropped when it
+ * comes back in. Sending the same one again is always allowed. */
+void fwd_remember(struct fwd_dedup *d, unsigned char *buf, int length) {
+  unsigned long hash, now;
+  int i;
+
+  if(d->window == 0 || length < 14)
+    return;
+
+  i = fwd_dedup_entry(buf, length, &hash);
+  now = monotonic_ms();
+  pthread_mutex_lock(&(d->lock));
+  d->entry[i].hash = hash;
+  d->entry[i].port = NULL;
+  d->entry[i].seen = now != 0 ? now : 1;
+  pthread_mutex_unlock(&(d->lock));
+}
+
+
+
+/* Picks the frames of a transmit batch that go into the same packet as
+ * frames[first]: that one and the following frames to the same ifaddr that
+ * haven't been packed yet, in order, as long as they fit in size bytes.
+ * A broadcast (ifaddr NULL) goes to every peer, so frames aren't gathered
+ * across a broadcast that isn't in this packet, nor into a broadcast
+ * across a frame to a single peer. Their indexes are written to list and
+ * marked in packed, returns the number of frames. A size smaller than a
+ * frame gives one frame per packet. */
+int fwd_pack(struct mbn_txframe *frames, int count, int first, int size, char *packed, int *list) {
+  int i, n = 1, length = frames[first].length;
+
+  list[0] = first;
+  packed[first] = 1;
+  for(i=first+1; i<count && length < size; i++) {
+    if(packed[i])
+      continue;
+    if(frames[i].ifaddr != frames[first].ifaddr) {
+      if(frames[i].ifaddr == NULL || frames[first].ifaddr == NULL)
+        break;
+      continue;
+    }
+    /* don't let a later frame overtake this one */
+    if(length+frames[i].length > size)
+      break;
+    length += frames[i].length;
+    list[n++] = i;
+    packed[i] = 1;
+  }
+  return n;
+}
@@ -0,0 +1,79 @@
+/****************************************************************************
+**
+** Copyright (C) 2009 D&R Electronica Weesp B.V. All rights reserved.
+**
+** This file is part of the Axum/MambaNet digital mixing system.
+**
+** This file may be used under the terms of the GNU General Public
+** License version 2.0 as published by the Free Software Foundation
+** and appearing in the file LICENSE.GPL included in the packaging of
+** this file.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+****************************************************************************/
+
+#ifndef FWDTABLE_H
+#define FWDTABLE_H
+
+#include <pthread.h>
+
+#include "mbn.h"
+
+/* MambaNet addresses in the header of a raw frame (without the broadcast bit) */
+#define FWD_ADDRESS_TO(b) ( \
+    (((unsigned long)(b)[1]<<21) & 0x0FE00000) | (((unsigned long)(b)[2]<<14) & 0x001FC000) | \
+    (((unsigned long)(b)[3]<< 7) & 0x00003F80) | (((unsigned long)(b)[4]    ) & 0x0000007F))
+#define FWD_ADDRESS_FROM(b) ( \
+    (((unsigned long)(b)[5]<<21) & 0x0FE00000) | (((unsigned long)(b)[6]<<14) & 0x001FC000) | \
+    (((unsigned long)(b)[7]<< 7) & 0x00003F80) | (((unsigned long)(b)[8]    ) & 0x0000007F))
+
+/* entries of the broadcast cache, power of two */
+#define FWD_DEDUPSIZE 1024
+
+struct fwd_entry {
+  unsigned long addr;
+  void *port;
+  unsigned long seen; /* monotonic_ms() */
+  int next; /* next entry in the same bucket or in the free list, -1 at the end */
+};
+
+/* Forwarding table of a stream server, maps the MambaNet addresses seen
+ * as AddressFrom to the connection (port) they came from. Entries are
+ * chained per bucket of a hash on the address. */
+struct fwd_table {
+  struct fwd_entry *entry;
+  int *bucket;
+  int size, buckets;
+  int count, free;
+  unsigned long timeout; /* milliseconds */
+  pthread_mutex_t lock;
+};
+
+/* Broadcasts seen recently by an interface, to drop the copies that come
+ * back in over a loop or a second path between networks. Direct mapped on
+ * a hash of AddressFrom, MessageID and the payload of the frame. */
+struct fwd_dedup {
+  struct {
+    unsigned long hash;
+    void *port; /* where it came in, NULL if sent by our own nodes */
+    unsigned long seen; /* monotonic_ms(), 0 if unused */
+  } entry[FWD_DEDUPSIZE];
+  unsigned long window; /* milliseconds, 0 disables */
+  pthread_mutex_t lock;
+};
+
+void fwd_init(struct fwd_table *, int, int);
+void fwd_free(struct fwd_table *);
+void fwd_learn(struct fwd_table *, unsigned long, void *);
+void *fwd_lookup(struct fwd_table *, unsigned long);
+void fwd_forget(struct fwd_table *, void *);
+void fwd_dedup_init(struct fwd_dedup *, int);
+void fwd_dedup_free(struct fwd_dedup *);
+int fwd_duplicate(struct mbn_interface *, struct fwd_dedup *, unsigned char *, int, void *);
+void fwd_remember(struct fwd_dedup *, unsigned char *, int);
+int fwd_pack(struct mbn_txframe *, int, int, int, char *, int *);
+
+#endif
+
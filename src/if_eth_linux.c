@@ -14,6 +14,8 @@
 **
 ****************************************************************************/
 
+#define _GNU_SOURCE /* sendmmsg() */
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,33 +27,103 @@
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <linux/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <ifaddrs.h>
 #include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "mbn.h"
+#include "fwdtable.h"
+#include "address.h"
 
 #define ETH_P_DNR  0x8820
-#define BUFFERSIZE 512
+/* defaults for the interface configuration */
+#define BUFFERSIZE ETH_DATA_LEN
 #define ADDLSTSIZE 1000 /* assume we don't have more than 1000 nodes on ethernet */
+#define ADDRTIMEOUT 300 /* seconds after which a MAC address that hasn't sent anything is forgotten */
+#define PACKETSIZE -1 /* one frame per ethernet frame, for nodes that only read the first */
+#define RINGSIZE -1 /* no receive ring, it delays packets that come in alone */
+#define RECEIVERTHREADS 1 /* more than one joins the sockets in a fanout group */
 
+/* the receive ring is handed over by the kernel in blocks of packets */
+#define RINGBLOCKSIZE (1<<16)
+#define RINGFRAMESIZE 2048 /* only used by the kernel to check the ring size */
+#define RINGTIMEOUT 1 /* milliseconds before a block that isn't full is handed over */
 
 
-struct ethdat {
+
+/* MAC address of a node, the ifaddr of the frames it sent */
+struct ethaddr {
+  unsigned char mac[6]; /* all 0 if unused, first so the ifaddr is the MAC address */
+  unsigned long seen; /* monotonic_ms() */
+  int next; /* next address in the same bucket or in the free list, -1 at the end */
+  int active; /* index in the active list */
+  char used; /* handed to the library, until ethernet_free_addr() */
+};
+
+/* spread the MAC addresses over the buckets, the last bytes differ the most */
+#define ETH_HASH(d, m) (((((unsigned long)(m)[2]<<24 | (unsigned long)(m)[3]<<16 | (m)[4]<<8 | (m)[5]) ^ ((m)[0]<<8 | (m)[1]))\
+                         * 2654435761UL >> 12) & ((d)->buckets-1))
+
+/* socket with a thread receiving from it, with more than one thread
+ * the kernel spreads the packets over them by source address */
+struct ethrecv {
+  struct mbn_interface *itf;
   int socket;
+  unsigned char *buffer;
+  unsigned char *ring; /* memory mapped receive ring, NULL when recvfrom() is used */
+  int blocks, block; /* number of blocks in the ring, and the next one to read */
+  pthread_t thread;
+  int started;
+};
+
+struct ethdat {
+  int socket; /* also the socket of the first receiver */
   int ifindex;
   unsigned char address[6];
-  unsigned char macs[ADDLSTSIZE][6];
-  pthread_t thread;
+  /* address list, AddressListSize entries chained per bucket of a hash
+   * on the MAC address, plus a list of the ones in use to age them */
+  struct ethaddr *addr;
+  int *bucket, buckets, free;
+  int *active, count;
+  unsigned long aged; /* monotonic_ms() of the last check for idle addresses */
+  pthread_rwlock_t addrlock; /* write-locked to add or remove addresses */
+  struct ethrecv *recv;
+  int receivers; /* 0 until the interface has been started */
+  int fanout; /* id of the fanout group */
+  /* rtnetlink socket telling us about changes in the link status */
+  int netlink;
+  int link; /* MBN_CONNECTION_UP or _DOWN, -1 until the interface has been started */
+  pthread_t linkthread;
+  int linkstarted;
 };
 
 int ethernet_init(struct mbn_interface *, char *);
+int ethernet_bind(struct mbn_interface *, struct ethdat *, int, char *);
+int ethernet_receiver(struct mbn_interface *, struct ethdat *, struct ethrecv *, char *);
+int ethernet_ring(struct mbn_interface *, struct ethrecv *, char *);
+int ethernet_fanout(struct ethdat *, struct ethrecv *, char *);
+int ethernet_netlink(struct ethdat *, char *);
+int ethernet_link(struct ethdat *, char *);
+void ethernet_link_state(struct mbn_interface *, struct ethdat *, int);
+void *link_thread(void *);
+void *ethernet_hwaddr(struct mbn_interface *, struct ethdat *, unsigned char *);
+void ethernet_remove_addr(struct mbn_interface *, struct ethdat *, int);
+void ethernet_age_addrs(struct mbn_interface *, struct ethdat *, unsigned long);
+void ethernet_receive(struct mbn_interface *, struct ethdat *, unsigned char *, int, unsigned char *);
 void *receive_packets(void *);
+void *receive_ring(void *);
 void ethernet_stop(struct mbn_interface *itf);
 void ethernet_free(struct mbn_interface *);
 void ethernet_free_addr(struct mbn_interface *, void *);
 int transmit(struct mbn_interface *, unsigned char *, int, void *, char *);
+int transmit_batch(struct mbn_interface *, struct mbn_txframe *, int, char *);
 
 
 /* fetch a list of ethernet interfaces */
@@ -103,13 +175,15 @@ void MBN_EXPORT mbnEthernetIFFree(struct mbn_if_ethernet *list) {
 
 
 struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *interface, char *err) {
+  return mbnEthernetOpenConfig(interface, NULL, err);
+}
+
+
+struct mbn_interface * MBN_EXPORT mbnEthernetOpenConfig(char *interface, struct mbn_if_config *config, char *err) {
   struct ethdat *data;
   struct mbn_interface *itf;
   struct ifreq ethreq;
-  int error = 0;
-  struct sockaddr_ll sockaddr;
-
-  memset(&sockaddr, 0, sizeof(struct sockaddr_ll));
+  int i, error = 0;
 
   if(interface == NULL) {
     sprintf(err, "No interface specified");
@@ -117,14 +191,38 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *interface, char *err) {
   }
 
   itf = (struct mbn_interface *) calloc(1, sizeof(struct mbn_interface));
+  itf->config.BufferSize = BUFFERSIZE;
+  itf->config.AddressListSize = ADDLSTSIZE;
+  itf->config.PacketSize = PACKETSIZE;
+  itf->config.RingSize = RINGSIZE;
+  itf->config.Threads = RECEIVERTHREADS;
+  itf->config.ForwardTimeout = ADDRTIMEOUT;
+  if(mbnInterfaceConfig(itf, config, err) != 0) {
+    free(itf);
+    return NULL;
+  }
   data = (struct ethdat *) calloc(1, sizeof(struct ethdat));
+  data->addr = (struct ethaddr *) calloc(itf->config.AddressListSize, sizeof(struct ethaddr));
+  data->active = (int *) malloc(itf->config.AddressListSize*sizeof(int));
+  for(data->buckets=16; data->buckets < itf->config.AddressListSize; data->buckets *= 2)
+    ;
+  data->bucket = (int *) malloc(data->buckets*sizeof(int));
+  for(i=0; i<data->buckets; i++)
+    data->bucket[i] = -1;
+  for(i=0; i<itf->config.AddressListSize; i++)
+    data->addr[i].next = i+1 < itf->config.AddressListSize ? i+1 : -1;
+  data->free = itf->config.AddressListSize > 0 ? 0 : -1;
+  data->aged = monotonic_ms();
+  pthread_rwlock_init(&(data->addrlock), NULL);
+  data->netlink = -1;
+  data->link = -1;
+  data->recv = (struct ethrecv *) calloc(itf->config.Threads, sizeof(struct ethrecv));
+  data->recv[0].itf = itf;
+  data->recv[0].buffer = (unsigned char *) malloc(itf->config.BufferSize);
   itf->data = (void *) data;
 
-  /* create a socket
-   * Note we use ETH_P_ALL here, because that's the only way to receive
-   *  outgoing packets from other processes as well as incoming packets
-   *  from the network. */
-  data->socket = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+  /* create a socket, it doesn't receive anything until it is bound */
+  data->socket = socket(AF_PACKET, SOCK_DGRAM, 0);
   if(data->socket < 0) {
     sprintf(err, "socket(): %s", strerror(errno));
     error++;
@@ -151,19 +249,30 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *interface, char *err) {
   } else
     memcpy(data->address, ethreq.ifr_hwaddr.sa_data, 6);
 
+  /* packed frames have to fit in one ethernet frame */
+  if(!error && itf->config.PacketSize > 0) {
+    if(ioctl(data->socket, SIOCGIFMTU, &ethreq) < 0) {
+      sprintf(err, "Couldn't get MTU: %s", strerror(errno));
+      error++;
+    } else if(itf->config.PacketSize > ethreq.ifr_mtu)
+      itf->config.PacketSize = ethreq.ifr_mtu;
+  }
+
   /* bind socket with the interface */
-  sockaddr.sll_family = AF_PACKET;
-  sockaddr.sll_protocol = htons(ETH_P_ALL);
-  sockaddr.sll_ifindex = data->ifindex;
-  if(!error && bind(data->socket, (struct sockaddr *) &sockaddr, sizeof(struct sockaddr_ll)) < 0) {
-    sprintf(err, "Couldn't bind socket: %s", strerror(errno));
+  if(!error && ethernet_bind(itf, data, data->socket, err) != 0)
     error++;
-  }
+  data->recv[0].socket = data->socket;
 
   /* something went wrong in the above statements */
   if(error) {
     close(data->socket);
     free(itf);
+    free(data->addr);
+    free(data->active);
+    free(data->bucket);
+    pthread_rwlock_destroy(&(data->addrlock));
+    free(data->recv[0].buffer);
+    free(data->recv);
     free(data);
     return NULL;
   }
@@ -173,6 +282,7 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *interface, char *err) {
   itf->cb_free = ethernet_free;
   itf->cb_free_addr = ethernet_free_addr;
   itf->cb_transmit = transmit;
+  itf->cb_transmit_batch = transmit_batch;
 
   return itf;
 }
@@ -180,12 +290,61 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *interface, char *err) {
 
 int ethernet_init(struct mbn_interface *itf, char *err) {
   struct ethdat *dat = (struct ethdat *)itf->data;
-  int i;
+  struct ethrecv *r;
+  int i, n = itf->config.Threads;
+
+  /* set up the receive sockets the first time we're started */
+  for(i=0; dat->receivers == 0 && i<n; i++) {
+    r = &(dat->recv[i]);
+    if(i > 0 && ethernet_receiver(itf, dat, r, err) != 0) {
+      mbnWriteLogMessage(itf, "%s, receiving with %d thread(s)", err, i);
+      break;
+    }
+    /* read from the receive ring, or one packet at a time if we can't have one */
+    if(itf->config.RingSize >= RINGBLOCKSIZE && ethernet_ring(itf, r, err) != 0)
+      mbnWriteLogMessage(itf, "%s, receiving one packet at a time", err);
+    if(n > 1 && ethernet_fanout(dat, r, err) != 0) {
+      mbnWriteLogMessage(itf, "%s, receiving with %d thread(s)", err, i > 0 ? i : 1);
+      if(i > 0) {
+        if(r->ring != NULL)
+          munmap(r->ring, r->blocks*RINGBLOCKSIZE);
+        close(r->socket);
+        free(r->buffer);
+      }
+      break;
+    }
+  }
+  if(dat->receivers == 0)
+    dat->receivers = i > 0 ? i : 1;
+
+  /* follow the link status, without it we only notice a lost link
+   * when the nodes on the other side time out */
+  if(dat->link < 0) {
+    if(ethernet_netlink(dat, err) != 0 || (dat->link = ethernet_link(dat, err)) < 0) {
+      mbnWriteLogMessage(itf, "%s, link status changes aren't noticed", err);
+      dat->link = MBN_CONNECTION_UP;
+      if(dat->netlink >= 0)
+        close(dat->netlink);
+      dat->netlink = -1;
+    }
+  }
+  if(dat->netlink >= 0) {
+    if((n = pthread_create(&(dat->linkthread), NULL, link_thread, (void *) itf)) != 0) {
+      sprintf(err, "Can't create thread: %s (%d)", strerror(n), n);
+      return 1;
+    }
+    dat->linkstarted = 1;
+  }
 
-  /* create thread to wait for packets */
-  if((i = pthread_create(&(dat->thread), NULL, receive_packets, (void *) itf)) != 0) {
-    sprintf(err, "Can't create thread: %s (%d)", strerror(i), i);
-    return 1;
+  /* create threads to wait for packets */
+  for(i=0; i<dat->receivers; i++) {
+    r = &(dat->recv[i]);
+    if((n = pthread_create(&(r->thread), NULL, r->ring != NULL ? receive_ring : receive_packets, (void *) r)) != 0) {
+      sprintf(err, "Can't create thread: %s (%d)", strerror(n), n);
+      ethernet_stop(itf);
+      return 1;
+    }
+    r->started = 1;
   }
   return 0;
 }
@@ -193,54 +352,415 @@ int ethernet_init(struct mbn_interface *itf, char *err) {
 
 void ethernet_stop(struct mbn_interface *itf) {
   struct ethdat *dat = (struct ethdat *)itf->data;
-  pthread_cancel(dat->thread);
-  pthread_join(dat->thread, NULL);
+  int i;
+
+  if(dat->linkstarted) {
+    pthread_cancel(dat->linkthread);
+    pthread_join(dat->linkthread, NULL);
+    dat->linkstarted = 0;
+  }
+  for(i=0; i<dat->receivers; i++) {
+    if(!dat->recv[i].started)
+      continue;
+    pthread_cancel(dat->recv[i].thread);
+    pthread_join(dat->recv[i].thread, NULL);
+    dat->recv[i].started = 0;
+  }
 }
 
 void ethernet_free(struct mbn_interface *itf) {
   struct ethdat *dat = (struct ethdat *)itf->data;
-  pthread_cancel(dat->thread);
-  pthread_join(dat->thread, NULL);
+  struct ethrecv *r;
+  int i;
+
+  ethernet_stop(itf);
+  for(i=0; i<(dat->receivers > 0 ? dat->receivers : 1); i++) {
+    r = &(dat->recv[i]);
+    if(r->ring != NULL)
+      munmap(r->ring, r->blocks*RINGBLOCKSIZE);
+    /* the first one is also used to transmit */
+    if(i > 0)
+      close(r->socket);
+    free(r->buffer);
+  }
+  if(dat->netlink >= 0)
+    close(dat->netlink);
+  free(dat->recv);
+  free(dat->addr);
+  free(dat->active);
+  free(dat->bucket);
+  pthread_rwlock_destroy(&(dat->addrlock));
   free(dat);
   free(itf);
 }
 
 
+/* Binds a socket to the interface. Outgoing packets from other processes
+ * are only seen with ETH_P_ALL, which gets us everything on the interface,
+ * so let the kernel drop what isn't MambaNet. Otherwise the kernel only
+ * gives us incoming MambaNet. */
+int ethernet_bind(struct mbn_interface *itf, struct ethdat *dat, int sock, char *err) {
+  struct sockaddr_ll sockaddr;
+  /* accept MambaNet frames, drop everything else */
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_DNR, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    BPF_STMT(BPF_RET | BPF_K, 0)
+  };
+  struct sock_fprog filter;
+
+  if(itf->config.Loopback > 0) {
+    filter.len = sizeof(code)/sizeof(struct sock_filter);
+    filter.filter = code;
+    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, (void *)&filter, sizeof(filter)) < 0) {
+      sprintf(err, "Couldn't attach filter: %s", strerror(errno));
+      return 1;
+    }
+  }
+
+  memset(&sockaddr, 0, sizeof(struct sockaddr_ll));
+  sockaddr.sll_family = AF_PACKET;
+  sockaddr.sll_protocol = htons(itf->config.Loopback > 0 ? ETH_P_ALL : ETH_P_DNR);
+  sockaddr.sll_ifindex = dat->ifindex;
+  if(bind(sock, (struct sockaddr *) &sockaddr, sizeof(struct sockaddr_ll)) < 0) {
+    sprintf(err, "Couldn't bind socket: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Opens the socket of an extra receive thread */
+int ethernet_receiver(struct mbn_interface *itf, struct ethdat *dat, struct ethrecv *r, char *err) {
+  r->itf = itf;
+  if((r->socket = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) {
+    sprintf(err, "socket(): %s", strerror(errno));
+    return 1;
+  }
+  if(ethernet_bind(itf, dat, r->socket, err) != 0) {
+    close(r->socket);
+    return 1;
+  }
+  r->buffer = (unsigned char *) malloc(itf->config.BufferSize);
+  return 0;
+}
+
+
+/* Sets up a TPACKET_V3 receive ring, the kernel fills whole blocks of
+ * packets in it that are read without a system call or a copy */
+int ethernet_ring(struct mbn_interface *itf, struct ethrecv *r, char *err) {
+  struct tpacket_req3 req;
+  int version = TPACKET_V3;
+  void *ring;
+
+  memset((void *)&req, 0, sizeof(struct tpacket_req3));
+  req.tp_block_size = RINGBLOCKSIZE;
+  req.tp_block_nr = itf->config.RingSize/RINGBLOCKSIZE;
+  req.tp_frame_size = RINGFRAMESIZE;
+  req.tp_frame_nr = req.tp_block_nr*(RINGBLOCKSIZE/RINGFRAMESIZE);
+  req.tp_retire_blk_tov = RINGTIMEOUT;
+
+  if(setsockopt(r->socket, SOL_PACKET, PACKET_VERSION, (void *)&version, sizeof(version)) < 0
+      || setsockopt(r->socket, SOL_PACKET, PACKET_RX_RING, (void *)&req, sizeof(req)) < 0) {
+    sprintf(err, "Can't set up receive ring: %s", strerror(errno));
+    return 1;
+  }
+  ring = mmap(NULL, req.tp_block_nr*RINGBLOCKSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, r->socket, 0);
+  if(ring == MAP_FAILED) {
+    sprintf(err, "Can't map receive ring: %s", strerror(errno));
+    return 1;
+  }
+  r->ring = (unsigned char *)ring;
+  r->blocks = req.tp_block_nr;
+  r->block = 0;
+  return 0;
+}
+
+
+/* Adds a receive socket to the fanout group of the interface. The first
+ * one creates the group, with a filter that picks a socket by the last
+ * four bytes of the source MAC address, so all packets of a node are
+ * handled by the same thread and stay in order. */
+int ethernet_fanout(struct ethdat *dat, struct ethrecv *r, char *err) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + 8),
+    BPF_STMT(BPF_RET | BPF_A, 0)
+  };
+  struct sock_fprog filter;
+  socklen_t len = sizeof(int);
+  int arg;
+
+  if(r == dat->recv) {
+    arg = (PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+    filter.len = sizeof(code)/sizeof(struct sock_filter);
+    filter.filter = code;
+    if(setsockopt(r->socket, SOL_PACKET, PACKET_FANOUT, (void *)&arg, sizeof(arg)) < 0
+        || getsockopt(r->socket, SOL_PACKET, PACKET_FANOUT, (void *)&arg, &len) < 0
+        || setsockopt(r->socket, SOL_PACKET, PACKET_FANOUT_DATA, (void *)&filter, sizeof(filter)) < 0) {
+      sprintf(err, "Can't create fanout group: %s", strerror(errno));
+      return 1;
+    }
+    dat->fanout = arg & 0xFFFF;
+    return 0;
+  }
+
+  arg = dat->fanout | (PACKET_FANOUT_CBPF << 16);
+  if(setsockopt(r->socket, SOL_PACKET, PACKET_FANOUT, (void *)&arg, sizeof(arg)) < 0) {
+    sprintf(err, "Can't join fanout group: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Opens a rtnetlink socket that receives the changes of all links */
+int ethernet_netlink(struct ethdat *dat, char *err) {
+  struct sockaddr_nl addr;
+
+  if((dat->netlink = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+    sprintf(err, "Can't open netlink socket: %s", strerror(errno));
+    return 1;
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_nl));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK;
+  if(bind(dat->netlink, (struct sockaddr *)&addr, sizeof(struct sockaddr_nl)) < 0) {
+    sprintf(err, "Can't bind netlink socket: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Returns MBN_CONNECTION_UP when the interface is up and has a carrier,
+ * MBN_CONNECTION_DOWN when it hasn't, or -1 on error */
+int ethernet_link(struct ethdat *dat, char *err) {
+  struct ifreq ifr;
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_ifindex = dat->ifindex;
+  if(ioctl(dat->socket, SIOCGIFNAME, &ifr) < 0 || ioctl(dat->socket, SIOCGIFFLAGS, &ifr) < 0) {
+    sprintf(err, "Can't get link status: %s", strerror(errno));
+    return -1;
+  }
+  return ifr.ifr_flags & IFF_RUNNING ? MBN_CONNECTION_UP : MBN_CONNECTION_DOWN;
+}
+
+
+/* Reports a change in the link status to the library, as the state of
+ * the connection to the network (with a NULL ifaddr) */
+void ethernet_link_state(struct mbn_interface *itf, struct ethdat *dat, int state) {
+  if(state == dat->link)
+    return;
+  dat->link = state;
+  mbnWriteLogMessage(itf, "Link %s", state == MBN_CONNECTION_UP ? "up" : "down");
+  mbnInterfaceConnectionState(itf, NULL, state);
+}
+
+
+/* Waits for changes in the link status of the interface */
+void *link_thread(void *ptr) {
+  struct mbn_interface *itf = (struct mbn_interface *)ptr;
+  struct ethdat *dat = (struct ethdat *) itf->data;
+  struct nlmsghdr buffer[512], *nh;
+  struct ifinfomsg *ifi;
+  char err[MBN_ERRSIZE];
+  int rd, state;
+
+  while(1) {
+    /* we can safely cancel here */
+    pthread_testcancel();
+
+    rd = recv(dat->netlink, (void *)buffer, sizeof(buffer), 0);
+    if(rd < 0 && errno == EINTR)
+      continue;
+    /* we've missed some changes, ask for the current status */
+    if(rd < 0 && errno == ENOBUFS) {
+      if((state = ethernet_link(dat, err)) >= 0)
+        ethernet_link_state(itf, dat, state);
+      continue;
+    }
+    if(rd < 0) {
+      mbnWriteLogMessage(itf, "Couldn't receive link status: %s", strerror(errno));
+      break;
+    }
+
+    for(nh=buffer; NLMSG_OK(nh, rd); nh=NLMSG_NEXT(nh, rd)) {
+      if(nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+        continue;
+      ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+      if(ifi->ifi_index != dat->ifindex)
+        continue;
+      if(nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_RUNNING))
+        ethernet_link_state(itf, dat, MBN_CONNECTION_UP);
+      else
+        ethernet_link_state(itf, dat, MBN_CONNECTION_DOWN);
+    }
+  }
+
+  return NULL;
+}
+
+
+/* Called when the library doesn't use an address anymore */
 void ethernet_free_addr(struct mbn_interface *itf, void *arg) {
-  mbnWriteLogMessage(itf, "Remove Ethernet address %02X:%02X:%02X:%02X:%02X:%02X", ((unsigned char *)arg)[0],
-                                                                                   ((unsigned char *)arg)[1],
-                                                                                   ((unsigned char *)arg)[2],
-                                                                                   ((unsigned char *)arg)[3],
-                                                                                   ((unsigned char *)arg)[4],
-                                                                                   ((unsigned char *)arg)[5]);
-  memset(arg, 0, 6);
+  struct ethdat *dat = (struct ethdat *)itf->data;
+  struct ethaddr *addr = arg;
+
+  pthread_rwlock_wrlock(&(dat->addrlock));
+  if(memcmp(addr->mac, "\0\0\0\0\0\0", 6) != 0)
+    ethernet_remove_addr(itf, dat, addr-dat->addr);
+  pthread_rwlock_unlock(&(dat->addrlock));
+}
+
+
+/* Takes an address out of the list, dat->addrlock should be write-locked */
+void ethernet_remove_addr(struct mbn_interface *itf, struct ethdat *dat, int i) {
+  struct ethaddr *addr = &(dat->addr[i]);
+  int *p;
+
+  mbnWriteLogMessage(itf, "Remove Ethernet address %02X:%02X:%02X:%02X:%02X:%02X", addr->mac[0], addr->mac[1],
+                                                      addr->mac[2], addr->mac[3], addr->mac[4], addr->mac[5]);
+
+  /* unlink from its bucket */
+  for(p=&(dat->bucket[ETH_HASH(dat, addr->mac)]); *p != i; p=&(dat->addr[*p].next))
+    ;
+  *p = addr->next;
+  /* move the last active address into its place */
+  dat->active[addr->active] = dat->active[--dat->count];
+  dat->addr[dat->active[addr->active]].active = addr->active;
+
+  memset(addr->mac, 0, 6);
+  addr->used = 0;
+  addr->next = dat->free;
+  dat->free = i;
+}
+
+
+/* Forgets the addresses that haven't sent anything for ForwardTimeout
+ * seconds. The ones the library may still have in its address table are
+ * kept, whatever their timeouts, those are removed by ethernet_free_addr().
+ * dat->addrlock should be write-locked */
+void ethernet_age_addrs(struct mbn_interface *itf, struct ethdat *dat, unsigned long now) {
+  int k;
+
+  dat->aged = now;
+  for(k=dat->count-1; k>=0; k--)
+    if(!dat->addr[dat->active[k]].used && now-dat->addr[dat->active[k]].seen >= (unsigned long)itf->config.ForwardTimeout*1000)
+      ethernet_remove_addr(itf, dat, dat->active[k]);
+}
+
+
+/* Returns the entry in the address list of a MAC address, which is
+ * added if we didn't know it yet, and marks it used by the library.
+ * Returns NULL if the list is full. */
+void *ethernet_hwaddr(struct mbn_interface *itf, struct ethdat *dat, unsigned char *mac) {
+  struct ethaddr *addr;
+  unsigned long now = monotonic_ms();
+  int i, h = ETH_HASH(dat, mac);
+
+  /* the receive threads look up known addresses side by side,
+   * seen is only a timestamp, so it's fine to set it without a write lock */
+  pthread_rwlock_rdlock(&(dat->addrlock));
+  for(i=dat->bucket[h]; i >= 0; i=dat->addr[i].next)
+    if(memcmp(dat->addr[i].mac, mac, 6) == 0)
+      break;
+  if(i >= 0) {
+    dat->addr[i].seen = now;
+    dat->addr[i].used = 1;
+    pthread_rwlock_unlock(&(dat->addrlock));
+    return &(dat->addr[i]);
+  }
+  pthread_rwlock_unlock(&(dat->addrlock));
+
+  /* new address, another thread may have added it in the meantime */
+  pthread_rwlock_wrlock(&(dat->addrlock));
+  for(i=dat->bucket[h]; i >= 0; i=dat->addr[i].next)
+    if(memcmp(dat->addr[i].mac, mac, 6) == 0)
+      break;
+  if(i < 0) {
+    /* make room by forgetting the idle addresses */
+    if(dat->free < 0)
+      ethernet_age_addrs(itf, dat, now);
+    if((i = dat->free) < 0) {
+      pthread_rwlock_unlock(&(dat->addrlock));
+      return NULL;
+    }
+    addr = &(dat->addr[i]);
+    dat->free = addr->next;
+    memcpy(addr->mac, mac, 6);
+    addr->next = dat->bucket[h];
+    dat->bucket[h] = i;
+    addr->active = dat->count;
+    dat->active[dat->count++] = i;
+    mbnWriteLogMessage(itf, "Add Ethernet address %02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+  dat->addr[i].seen = now;
+  dat->addr[i].used = 1;
+  pthread_rwlock_unlock(&(dat->addrlock));
+  return &(dat->addr[i]);
+}
+
+
+/* Handles the frames in a packet from mac right where they are */
+void ethernet_receive(struct mbn_interface *itf, struct ethdat *dat, unsigned char *buffer, int length, unsigned char *mac) {
+  void *ifaddr = NULL;
+  int i, start = -1;
+
+  for(i=0; i<length; i++) {
+    /* ignore non-start bytes if we haven't started yet */
+    if(start < 0) {
+      if(buffer[i] >= 0x80 && buffer[i] < 0xFF)
+        start = i;
+      continue;
+    }
+    /* we have a full message, send it to mambanet stack for processing */
+    if(buffer[i] == 0xFF) {
+      if(i-start+1 >= MBN_MIN_MESSAGE_SIZE) {
+        if(ifaddr == NULL)
+          ifaddr = ethernet_hwaddr(itf, dat, mac);
+        mbnProcessRawMessage(itf, buffer+start, i-start+1, ifaddr);
+      }
+      start = -1;
+    /* message was way too long, ignore it */
+    } else if(i-start+1 >= MBN_MAX_MESSAGE_SIZE)
+      start = -1;
+  }
 }
 
 
 /* Waits for input from network */
 void *receive_packets(void *ptr) {
-  struct mbn_interface *itf = (struct mbn_interface *)ptr;
+  struct ethrecv *r = (struct ethrecv *)ptr;
+  struct mbn_interface *itf = r->itf;
   struct ethdat *dat = (struct ethdat *) itf->data;
-  unsigned char buffer[BUFFERSIZE], msgbuf[MBN_MAX_MESSAGE_SIZE];
+  unsigned char *buffer = r->buffer;
   char err[MBN_ERRSIZE];
-  int i, j, msgbuflen = 0;
   fd_set rdfd;
   struct timeval tv;
   struct sockaddr_ll from;
   ssize_t rd;
-  void *ifaddr, *hwaddr;
   socklen_t addrlength = sizeof(struct sockaddr_ll);
 
   while(1) {
     /* we can safely cancel here */
     pthread_testcancel();
 
+    /* forget the addresses we haven't heard from for a while */
+    if(monotonic_ms()-dat->aged >= 1000) {
+      pthread_rwlock_wrlock(&(dat->addrlock));
+      if(monotonic_ms()-dat->aged >= 1000)
+        ethernet_age_addrs(itf, dat, monotonic_ms());
+      pthread_rwlock_unlock(&(dat->addrlock));
+    }
+
     /* check for incoming data */
     FD_ZERO(&rdfd);
-    FD_SET(dat->socket, &rdfd);
+    FD_SET(r->socket, &rdfd);
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    rd = select(dat->socket+1, &rdfd, NULL, NULL, &tv);
+    rd = select(r->socket+1, &rdfd, NULL, NULL, &tv);
     if(rd == 0 || (rd < 0 && errno == EINTR))
       continue;
     if(rd < 0) {
@@ -250,7 +770,7 @@ void *receive_packets(void *ptr) {
     }
 
     /* read incoming data */
-    rd = recvfrom(dat->socket, buffer, BUFFERSIZE, 0, (struct sockaddr *)&from, &addrlength);
+    rd = recvfrom(r->socket, buffer, itf->config.BufferSize, 0, (struct sockaddr *)&from, &addrlength);
     if(rd == 0 || (rd < 0 && errno == EINTR))
       continue;
     if(rd < 0) {
@@ -262,43 +782,72 @@ void *receive_packets(void *ptr) {
       continue;
 
     /* handle the data */
-    for(i=0; i<rd; i++) {
-      /* ignore non-start bytes if we haven't started yet */
-      if(msgbuflen == 0 && !(buffer[i] >= 0x80 && buffer[i] < 0xFF))
-        continue;
-      msgbuf[msgbuflen++] = buffer[i];
-      /* we have a full message, send buffer to mambanet stack for processing */
-      if(buffer[i] == 0xFF) {
-        if(msgbuflen >= MBN_MIN_MESSAGE_SIZE) {
-          /* get HW address pointer from mbn */
-          hwaddr = ifaddr = NULL;
-          for(j=0; j<ADDLSTSIZE-1; j++) {
-            if(hwaddr == NULL && memcmp(dat->macs[j], "\0\0\0\0\0\0", 6) == 0)
-              hwaddr = dat->macs[j];
-            if(memcmp(dat->macs[j], (void *)from.sll_addr, 6) == 0) {
-              ifaddr = dat->macs[j];
-              break;
-            }
-          }
-          if(ifaddr == NULL) {
-            ifaddr = hwaddr;
-            memcpy(ifaddr, (void *)from.sll_addr, 6);
-
-            mbnWriteLogMessage(itf, "Add Ethernet address %02X:%02X:%02X:%02X:%02X:%02X", ((unsigned char *)hwaddr)[0],
-                                                                                          ((unsigned char *)hwaddr)[1],
-                                                                                          ((unsigned char *)hwaddr)[2],
-                                                                                          ((unsigned char *)hwaddr)[3],
-                                                                                          ((unsigned char *)hwaddr)[4],
-                                                                                          ((unsigned char *)hwaddr)[5]);
-          }
-          mbnProcessRawMessage(itf, msgbuf, msgbuflen, ifaddr);
-        }
-        msgbuflen = 0;
+    ethernet_receive(itf, dat, buffer, rd, from.sll_addr);
+  }
+
+  return NULL;
+}
+
+
+/* Waits for blocks of packets in the receive ring, and hands each
+ * block back to the kernel once all its packets have been handled. The
+ * frames sent in reply to a block, such as acknowledgements, are sent
+ * together when the block is done. */
+void *receive_ring(void *ptr) {
+  struct ethrecv *r = (struct ethrecv *)ptr;
+  struct mbn_interface *itf = r->itf;
+  struct ethdat *dat = (struct ethdat *) itf->data;
+  struct tpacket_block_desc *block;
+  struct tpacket3_hdr *hdr;
+  struct sockaddr_ll *from;
+  struct pollfd pfd;
+  char err[MBN_ERRSIZE];
+  unsigned int i;
+
+  pfd.fd = r->socket;
+  pfd.events = POLLIN | POLLERR;
+
+  while(1) {
+    /* we can safely cancel here */
+    pthread_testcancel();
+
+    /* forget the addresses we haven't heard from for a while */
+    if(monotonic_ms()-dat->aged >= 1000) {
+      pthread_rwlock_wrlock(&(dat->addrlock));
+      if(monotonic_ms()-dat->aged >= 1000)
+        ethernet_age_addrs(itf, dat, monotonic_ms());
+      pthread_rwlock_unlock(&(dat->addrlock));
+    }
+
+    block = (struct tpacket_block_desc *)(r->ring+r->block*RINGBLOCKSIZE);
+    if(!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+      if(poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+        sprintf(err, "Couldn't check for new packets: %s", strerror(errno));
+        mbnInterfaceReadError(itf, err);
+        break;
       }
-      /* message was way too long, ignore it */
-      if(msgbuflen >= MBN_MAX_MESSAGE_SIZE)
-        msgbuflen = 0;
+      continue;
     }
+    /* don't read the packets before the kernel is done with them */
+    __sync_synchronize();
+
+    /* the batch is shared by all threads, so with several receivers the
+     * blocks would overlap and keep it open, only batch with one receiver */
+    if(dat->receivers == 1)
+      mbnStartBatch(itf->mbn);
+    hdr = (struct tpacket3_hdr *)((unsigned char *)block+block->hdr.bh1.offset_to_first_pkt);
+    for(i=0; i<block->hdr.bh1.num_pkts; i++) {
+      from = (struct sockaddr_ll *)((unsigned char *)hdr+TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+      if(htons(from->sll_protocol) == ETH_P_DNR)
+        ethernet_receive(itf, dat, (unsigned char *)hdr+hdr->tp_mac, hdr->tp_snaplen, from->sll_addr);
+      hdr = (struct tpacket3_hdr *)((unsigned char *)hdr+hdr->tp_next_offset);
+    }
+    if(dat->receivers == 1)
+      mbnFlushBatch(itf->mbn);
+
+    __sync_synchronize();
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    r->block = (r->block+1)%r->blocks;
   }
 
   return NULL;
@@ -309,7 +858,6 @@ int transmit(struct mbn_interface *itf, unsigned char *buffer, int length, void
   struct ethdat *dat = (struct ethdat *) itf->data;
   unsigned char *addr = (unsigned char *) ifaddr;
   struct sockaddr_ll saddr;
-  int rd, sent;
 
   /* fill sockaddr struct */
   memset((void *)&saddr, 0, sizeof(struct sockaddr_ll));
@@ -324,41 +872,83 @@ int transmit(struct mbn_interface *itf, unsigned char *buffer, int length, void
   else
     memset(saddr.sll_addr, 0xFF, 6);
 
-  /* send data */
-  sent = 0;
-  while((rd = sendto(dat->socket, &(buffer[sent]), length-sent, 0, (struct sockaddr *)&saddr, sizeof(struct sockaddr_ll))) < length-sent) {
-    if(rd < 0) {
+  /* send data, a packet socket sends all of it or nothing */
+  while(sendto(dat->socket, buffer, length, 0, (struct sockaddr *)&saddr, sizeof(struct sockaddr_ll)) < 0) {
+    if(errno != EINTR) {
       sprintf(err, "Can't send packet: %s", strerror(errno));
       return 1;
     }
-    sent += rd;
   }
   return 0;
 }
 
-char MBN_EXPORT mbnEthernetMIILinkStatus(struct mbn_interface *itf, char *err) {
-  struct ethdat *dat = (struct ethdat *)itf->data;
-  struct ifreq ifr;
 
-  memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_ifindex = dat->ifindex;
+/* Sends a batch of frames with a single sendmmsg() call (or a few, in
+ * case the kernel accepts only part of them), one ethernet frame each,
+ * or with a PacketSize, the frames for the same address packed together. */
+int transmit_batch(struct mbn_interface *itf, struct mbn_txframe *frames, int count, char *err) {
+  struct ethdat *dat = (struct ethdat *) itf->data;
+  struct sockaddr_ll saddr[MBN_TX_BATCH];
+  struct iovec iov[MBN_TX_BATCH];
+  struct mmsghdr msg[MBN_TX_BATCH];
+  char packed[MBN_TX_BATCH];
+  int list[MBN_TX_BATCH];
+  int i, j, k, l, m, n, rd;
+
+  while(count > 0) {
+    n = count > MBN_TX_BATCH ? MBN_TX_BATCH : count;
+    memset((void *)saddr, 0, n*sizeof(struct sockaddr_ll));
+    memset((void *)msg, 0, n*sizeof(struct mmsghdr));
+    memset((void *)packed, 0, n);
+    for(i=0, j=0, m=0; i<n; i++) {
+      if(packed[i])
+        continue;
+      k = fwd_pack(frames, n, i, itf->config.PacketSize, packed, list);
+      saddr[m].sll_family   = AF_PACKET;
+      saddr[m].sll_protocol = htons(ETH_P_DNR);
+      saddr[m].sll_ifindex  = dat->ifindex;
+      saddr[m].sll_hatype   = ARPHRD_ETHER;
+      saddr[m].sll_pkttype  = PACKET_OTHERHOST;
+      saddr[m].sll_halen    = ETH_ALEN;
+      if(frames[i].ifaddr != NULL)
+        memcpy(saddr[m].sll_addr, frames[i].ifaddr, 6);
+      else
+        memset(saddr[m].sll_addr, 0xFF, 6);
+      msg[m].msg_hdr.msg_name = &(saddr[m]);
+      msg[m].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+      msg[m].msg_hdr.msg_iov = &(iov[j]);
+      msg[m].msg_hdr.msg_iovlen = k;
+      for(l=0; l<k; l++) {
+        iov[j+l].iov_base = frames[list[l]].buffer;
+        iov[j+l].iov_len = frames[list[l]].length;
+      }
+      j += k;
+      m++;
+    }
 
-  if (ioctl(dat->socket, SIOCGIFNAME, &ifr) == -1) {
-    sprintf(err, "SIOCGIFNAME failed: %s", strerror(errno));
-    return -1;
-  }
-  if (ioctl(dat->socket, SIOCGMIIPHY, &ifr) == -1) {
-    sprintf(err, "SIOCGMIIPHY failed: %s", strerror(errno));
-    return -1;
+    for(i=0; i<m; i+=rd) {
+      if((rd = sendmmsg(dat->socket, &(msg[i]), m-i, 0)) < 0) {
+        if(errno == EINTR) {
+          rd = 0;
+          continue;
+        }
+        sprintf(err, "Can't send packet: %s", strerror(errno));
+        return 1;
+      }
+    }
+    frames += n;
+    count -= n;
   }
+  return 0;
+}
 
-  ((unsigned short*) &ifr.ifr_data)[1] = 1;
+/* Returns 1 when the interface has a link, 0 when it hasn't, or -1 when
+ * this can't be found out. This is the carrier the driver reports, which
+ * doesn't need a driver that gives access to the MII registers of the PHY. */
+char MBN_EXPORT mbnEthernetMIILinkStatus(struct mbn_interface *itf, char *err) {
+  int state = ethernet_link((struct ethdat *)itf->data, err);
 
-  if (ioctl(dat->socket, SIOCGMIIREG, &ifr) == -1) {
-    sprintf(err, "SIOCGMIIREG failed: %s", strerror(errno));
+  if(state < 0)
     return -1;
-  }
-
-  return (((unsigned short*) &ifr.ifr_data)[3] & 0x0004) ? 1 : 0;
+  return state == MBN_CONNECTION_UP ? 1 : 0;
 }
-
@@ -29,6 +29,7 @@
 #include "mbn.h"
 
 
+/* defaults for the interface configuration */
 #define BUFFERSIZE 512
 #define ADDLSTSIZE 1000
 
@@ -97,7 +98,7 @@ struct pcapdat {
   pthread_t thread;
   char thread_run;
   unsigned char mymac[6];
-  unsigned char macs[ADDLSTSIZE][6];
+  unsigned char (*macs)[6];
 };
 
 
@@ -182,6 +183,11 @@ void MBN_EXPORT mbnEthernetIFFree(struct mbn_if_ethernet *list) {
 
 
 struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *ifname, char *err) {
+  return mbnEthernetOpenConfig(ifname, NULL, err);
+}
+
+
+struct mbn_interface * MBN_EXPORT mbnEthernetOpenConfig(char *ifname, struct mbn_if_config *config, char *err) {
   struct mbn_interface *itf;
   struct pcapdat *dat;
   pcap_addr_t *a;
@@ -203,7 +209,14 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *ifname, char *err) {
   }
 
   itf = (struct mbn_interface *)calloc(1, sizeof(struct mbn_interface));
+  itf->config.BufferSize = BUFFERSIZE;
+  itf->config.AddressListSize = ADDLSTSIZE;
+  if(mbnInterfaceConfig(itf, config, err) != 0) {
+    free(itf);
+    return NULL;
+  }
   dat = (struct pcapdat *)calloc(1, sizeof(struct pcapdat));
+  dat->macs = calloc(itf->config.AddressListSize, 6);
   itf->data = (void *) dat;
 
 
@@ -225,7 +238,7 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *ifname, char *err) {
     sprintf(err, "Selected device not found");
     error++;
   }
-  if(!error && (pc = pcap_open_live(d->name, BUFFERSIZE, 0, 1, err+25)) == NULL) {
+  if(!error && (pc = pcap_open_live(d->name, itf->config.BufferSize, 0, 1, err+25)) == NULL) {
     memcpy((void *)err, (void *)"Couldn't open interface: ", 25);
     error++;
   }
@@ -270,6 +283,7 @@ struct mbn_interface * MBN_EXPORT mbnEthernetOpen(char *ifname, char *err) {
     pcap_freealldevs(devs);
 
   if(error) {
+    free(dat->macs);
     free(dat);
     free(itf);
     return NULL;
@@ -317,6 +331,7 @@ void free_pcap(struct mbn_interface *itf) {
   }
   pthread_cancel(dat->thread);
   pthread_join(dat->thread, NULL);
+  free(dat->macs);
   free(dat);
   free(itf);
 }
@@ -373,7 +388,7 @@ void *receive_packets(void *ptr) {
 
     /* get HW address pointer */
     hwaddr = ifaddr = NULL;
-    for(j=0; j<ADDLSTSIZE-1; j++) {
+    for(j=0; j<itf->config.AddressListSize-1; j++) {
       if(hwaddr == NULL && memcmp(dat->macs[j], "\0\0\0\0\0\0", 6) == 0)
         hwaddr = dat->macs[j];
       if(memcmp(dat->macs[j], buffer+6, 6) == 0) {
@@ -381,7 +396,7 @@ void *receive_packets(void *ptr) {
         break;
       }
     }
-    if(ifaddr == NULL) {
+    if(ifaddr == NULL && hwaddr != NULL) {
       ifaddr = hwaddr;
       memcpy(ifaddr, buffer+6, 6);
 
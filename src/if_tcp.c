@@ -15,6 +15,7 @@
 ****************************************************************************/
 
 
+#define _GNU_SOURCE /* SO_REUSEPORT */
 #define _XOPEN_SOURCE 600
 #define _XOPEN_SOURCE_EXTENDED 1
 
@@ -27,12 +28,16 @@
 
 #ifdef MBNP_linux
 # include <unistd.h>
+# include <fcntl.h>
 # include <sys/types.h>
 # include <sys/socket.h>
 # include <sys/select.h>
 # include <sys/time.h>
+# include <sys/epoll.h>
+# include <sys/uio.h>
 # include <netdb.h>
 # include <arpa/inet.h>
+# define TCP_EPOLL
 #else
 # define _WIN32_WINNT 0x0501 /* only works for ws2_32.dll > windows 2000 */
 # include <windows.h>
@@ -51,43 +56,155 @@
 #endif
 
 #include "mbn.h"
+#include "sendq.h"
+#include "address.h"
+#include "fwdtable.h"
 
 #define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
 #define MBN_TCP_PORT "34848"
-/* the actual number of max. connections is also limited by the
- * number of sockets the select() call accepts.
- * Each connection requires about 128 bytes for buffers */
-#define MAX_CONNECTIONS 64
-#define BUFFERSIZE     512
+/* defaults for the interface configuration,
+ * with select() the actual number of max. connections is also limited
+ * by the number of sockets the select() call accepts.
+ * Each connection has a receive buffer of BufferSize bytes, the connection
+ * table grows when needed, starting at CONNTABLESIZE entries */
+#ifdef TCP_EPOLL
+# define MAX_CONNECTIONS 4096
+# define RECV_FLAGS MSG_DONTWAIT
+#else
+# define MAX_CONNECTIONS 64
+# define RECV_FLAGS 0
+#endif
+#define BUFFERSIZE    8192
+/* the send queue of a connection is only allocated when the connection can't keep up */
+#define SENDQUEUESIZE  16384
+#define SENDQUEUEHIGH  12288
+#define SENDQUEUELOW    4096
+#define CONNTABLESIZE   16
+#define EPOLLEVENTS     64
+#define RECEIVERTHREADS  1 /* more than one only with epoll */
+/* forwarding table: number of addresses, and the seconds after which
+ * a node that hasn't sent anything is forgotten */
+#define ADDLSTSIZE     1000
+#define FORWARDTIMEOUT  300
+/* milliseconds a broadcast is remembered, to drop its copies */
+#define DUPLICATEWINDOW 100
+/* connection to the server: time-out of a connection attempt, and the delay
+ * before reconnecting after a failed attempt, doubled each time (milliseconds) */
+#define CONNECTTIMEOUT     3000
+#define RECONNECTDELAY      100
+#define RECONNECTMAXDELAY 10000
 
 
 struct tcpconn {
-  unsigned char buf[MBN_MAX_MESSAGE_SIZE];
-  int buflen;
+  unsigned char *buf; /* receive buffer, frames are processed right from here */
+  int buflen; /* bytes of an incomplete frame at the start of buf */
   int sock; /* -1 when unused */
   unsigned long remoteip;
   unsigned int remoteport;
+  struct sendq sendq;
+  char writing; /* waiting for the socket to become writable */
+  char closing; /* shut down by the transmit side, receiver will close it */
+  char server; /* connection to the server, stays in use while reconnecting */
+#ifdef TCP_EPOLL
+  int epoll; /* of the receiver thread serving this connection */
+#else
+  int wakeup; /* of the receiver thread, see watch_writable() */
+#endif
+  pthread_mutex_t lock; /* for sending, and changing the state of the connection */
 };
 
-struct tcpdat {
+/* A receiver thread, with more than one each has its own epoll instance,
+ * and its own listen socket if the system supports SO_REUSEPORT */
+struct tcpshard {
+  struct mbn_interface *itf;
   pthread_t thread;
-  char thread_run;
+  char thread_run, started;
   int listensocket;
-  int rconn;
-  struct tcpconn conn[MAX_CONNECTIONS];
+#ifdef TCP_EPOLL
+  int epoll;
+#else
+  int wakeup; /* UDP socket connected to itself, in the read set of select() */
+#endif
+};
+
+struct tcpdat {
+  struct tcpshard *shard;
+  int shards;
+  int handoff; /* receiver thread for the next accepted connection, without SO_REUSEPORT */
+  int rconn; /* socket to the server, also while connecting, -1 if there is none */
+  /* the connection to the server is made (and re-established when
+   * lost) by the receiver thread, without blocking */
+  struct addrinfo *raddr, *rtry; /* resolved addresses, next one to try */
+  char *rname;
+  int rstate; /* MBN_CONNECTION_* */
+  int rdelay; /* milliseconds to wait after the next failed attempt */
+  unsigned long rtime; /* start of the next attempt, or time-out of the current one */
+  /* the connections are allocated separately and never moved or freed
+   * before the interface is freed, because the pointers are used as ifaddr */
+  struct tcpconn **conn;
+  int connsize;
+  pthread_rwlock_t lock; /* connection table, write-locked to grow it and to add connections */
+  /* connection the nodes were seen on, to switch unicast messages between
+   * connections, our own nodes are learned as a pointer to this struct */
+  struct fwd_table fwd;
+  struct fwd_dedup dedup;
 };
 
 int setup_client(struct tcpdat *, char *, char *, char *);
 int setup_server(struct tcpdat *, char *, char *, char *);
+#ifndef TCP_EPOLL
+int wakeup_socket(void);
+#endif
 int init_tcp(struct mbn_interface *, char *);
 void stop_tcp(struct mbn_interface *);
 void free_tcp(struct mbn_interface *);
 void free_addr_tcp(struct mbn_interface *, void *);
 void *receiver(void *);
+void server_lost(struct mbn_interface *, struct tcpdat *);
+void transmit_connection(struct mbn_interface *, struct tcpconn *, unsigned char *, int);
 int tcptransmit(struct mbn_interface *, unsigned char *, int, void *, char *);
+int tcptransmit_batch(struct mbn_interface *, struct mbn_txframe *, int, char *);
+int queue_status_tcp(struct mbn_interface *, void *, struct mbn_queue_status *);
 
 
 struct mbn_interface * MBN_EXPORT mbnTCPOpen(char *remoteip, char *remoteport, char *myip, char *myport, char *err) {
+  return mbnTCPOpenConfig(remoteip, remoteport, myip, myport, NULL, err);
+}
+
+
+/* Makes sure the connection table has room for at least n connections, returns 0 if it does.
+ * dat->lock should be write-locked, when the receivers are running */
+int grow_connections(struct mbn_interface *itf, struct tcpdat *dat, int n) {
+  struct tcpconn **conn;
+  int i, size;
+
+  if(n <= dat->connsize)
+    return 0;
+  if(n > itf->config.MaxConnections)
+    return 1;
+
+  size = MIN(MAX(n, dat->connsize*2), itf->config.MaxConnections);
+  if((conn = (struct tcpconn **)malloc(size*sizeof(struct tcpconn *))) == NULL)
+    return 1;
+  for(i=dat->connsize; i<size; i++) {
+    conn[i] = (struct tcpconn *)calloc(1, sizeof(struct tcpconn));
+    conn[i]->buf = (unsigned char *)malloc(itf->config.BufferSize);
+    conn[i]->sock = -1;
+    sendq_init(&(conn[i]->sendq), &(itf->config));
+    pthread_mutex_init(&(conn[i]->lock), NULL);
+  }
+
+  if(dat->connsize > 0)
+    memcpy((void *)conn, (void *)dat->conn, dat->connsize*sizeof(struct tcpconn *));
+  free(dat->conn);
+  dat->conn = conn;
+  dat->connsize = size;
+  return 0;
+}
+
+
+struct mbn_interface * MBN_EXPORT mbnTCPOpenConfig(char *remoteip, char *remoteport, char *myip, char *myport, struct mbn_if_config *config, char *err) {
   struct mbn_interface *itf;
   struct tcpdat *dat;
   int i, error = 0;
@@ -103,17 +220,63 @@ struct mbn_interface * MBN_EXPORT mbnTCPOpen(char *remoteip, char *remoteport, c
 #endif
 
   itf = (struct mbn_interface *)calloc(1, sizeof(struct mbn_interface));
+  itf->config.BufferSize = BUFFERSIZE;
+  itf->config.MaxConnections = MAX_CONNECTIONS;
+  itf->config.SendQueueSize = SENDQUEUESIZE;
+  itf->config.SendQueueHigh = SENDQUEUEHIGH;
+  itf->config.SendQueueLow = SENDQUEUELOW;
+  itf->config.SlowConsumer = MBN_SLOWCONSUMER_DROP;
+  itf->config.ConnectTimeout = CONNECTTIMEOUT;
+  itf->config.ReconnectDelay = RECONNECTDELAY;
+  itf->config.ReconnectMaxDelay = RECONNECTMAXDELAY;
+  itf->config.Threads = RECEIVERTHREADS;
+  itf->config.AddressListSize = ADDLSTSIZE;
+  itf->config.ForwardTimeout = FORWARDTIMEOUT;
+  itf->config.DuplicateWindow = DUPLICATEWINDOW;
+  if(mbnInterfaceConfig(itf, config, err) != 0) {
+    free(itf);
+#ifdef MBNP_mingw
+    WSACleanup();
+#endif
+    return NULL;
+  }
   dat = (struct tcpdat *)calloc(1, sizeof(struct tcpdat));
   itf->data = (void *)dat;
 
   /* initialize connection table */
-  for(i=0; i<MAX_CONNECTIONS; i++)
-    dat->conn[i].sock = -1;
+  pthread_rwlock_init(&(dat->lock), NULL);
+  grow_connections(itf, dat, MIN(CONNTABLESIZE, itf->config.MaxConnections));
+  fwd_init(&(dat->fwd), itf->config.AddressListSize, itf->config.ForwardTimeout);
+  fwd_dedup_init(&(dat->dedup), itf->config.DuplicateWindow);
+
+  /* and the receiver threads */
+#ifdef TCP_EPOLL
+  dat->shards = itf->config.Threads;
+#else
+  dat->shards = 1;
+#endif
+  dat->shard = (struct tcpshard *)calloc(dat->shards, sizeof(struct tcpshard));
+  for(i=0; i<dat->shards; i++) {
+    dat->shard[i].itf = itf;
+    dat->shard[i].listensocket = -1;
+#ifdef TCP_EPOLL
+    if((dat->shard[i].epoll = epoll_create(EPOLLEVENTS)) < 0 && !error) {
+      sprintf(err, "epoll_create(): %s", strerror(errno));
+      error++;
+    }
+#else
+    if((dat->shard[i].wakeup = wakeup_socket()) < 0 && !error) {
+      sprintf(err, "Can't create wakeup socket: %s", strerror(errno));
+      error++;
+    }
+#endif
+  }
 
-  if(remoteip != NULL) {
+  if(!error && remoteip != NULL) {
     if(remoteport == NULL)
       remoteport = MBN_TCP_PORT;
     error += setup_client(dat, remoteip, remoteport, err);
+    dat->rdelay = itf->config.ReconnectDelay;
   } else
     dat->rconn = -1;
 
@@ -121,10 +284,33 @@ struct mbn_interface * MBN_EXPORT mbnTCPOpen(char *remoteip, char *remoteport, c
     if(myport == NULL)
       myport = MBN_TCP_PORT;
     error += setup_server(dat, myip, myport, err);
-  } else
-    dat->listensocket = -1;
+  }
 
   if(error) {
+    for(i=0; i<dat->shards; i++) {
+      if(dat->shard[i].listensocket >= 0)
+        close(dat->shard[i].listensocket);
+#ifdef TCP_EPOLL
+      if(dat->shard[i].epoll >= 0)
+        close(dat->shard[i].epoll);
+#else
+      if(dat->shard[i].wakeup >= 0)
+        close(dat->shard[i].wakeup);
+#endif
+    }
+    free(dat->shard);
+    for(i=0; i<dat->connsize; i++) {
+      pthread_mutex_destroy(&(dat->conn[i]->lock));
+      free(dat->conn[i]->buf);
+      free(dat->conn[i]);
+    }
+    if(dat->raddr != NULL)
+      freeaddrinfo(dat->raddr);
+    free(dat->rname);
+    free(dat->conn);
+    fwd_free(&(dat->fwd));
+    fwd_dedup_free(&(dat->dedup));
+    pthread_rwlock_destroy(&(dat->lock));
     free(dat);
     free(itf);
 #ifdef MBNP_mingw
@@ -138,50 +324,107 @@ struct mbn_interface * MBN_EXPORT mbnTCPOpen(char *remoteip, char *remoteport, c
   itf->cb_free = free_tcp;
   itf->cb_free_addr = free_addr_tcp;
   itf->cb_transmit = tcptransmit;
+  itf->cb_transmit_batch = tcptransmit_batch;
+  itf->cb_queue_status = queue_status_tcp;
   return itf;
 }
 
 
-/* TODO: non-blocking connect()? time-out? */
+/* Only resolves the address of the server, the connection itself is
+ * made by the receiver thread (see check_server()) */
 int setup_client(struct tcpdat *dat, char *server, char *port, char *err) {
-  struct addrinfo hint, *res, *rp;
+  struct addrinfo hint;
+  int r;
 
   /* lookup hostname/ip address */
   memset((void *)&hint, 0, sizeof(struct addrinfo));
   hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
 
-  if(getaddrinfo(server, port, &hint, &res) != 0) {
-    sprintf(err, "Can't resolve %s port %s: %s", server, port, strerror(errno));
+  if((r = getaddrinfo(server, port, &hint, &(dat->raddr))) != 0) {
+    sprintf(err, "Can't resolve %s port %s: %s", server, port, gai_strerror(r));
+    dat->raddr = NULL;
     return 1;
   }
 
-  /* loop through possibilities and try to connect */
-  for(rp=res; rp != NULL; rp=rp->ai_next) {
-    /* create socket */
-    if((dat->rconn = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
-      continue;
-    /* connect */
-    if(connect(dat->rconn, rp->ai_addr, rp->ai_addrlen) >= 0)
-      break;
-    close(dat->rconn);
-  }
+  dat->rname = (char *)malloc(strlen(server)+strlen(port)+7);
+  sprintf(dat->rname, "%s port %s", server, port);
+  dat->rconn = -1;
+  dat->rtry = NULL;
+  dat->rstate = MBN_CONNECTION_DOWN;
+  dat->rtime = monotonic_ms();
+  dat->conn[0]->server = 1;
+#ifdef TCP_EPOLL
+  dat->conn[0]->epoll = dat->shard[0].epoll;
+#else
+  dat->conn[0]->wakeup = dat->shard[0].wakeup;
+#endif
+  return 0;
+}
 
-  freeaddrinfo(res);
-  if(rp == NULL) {
-    sprintf("Couldn't connect to %s port %s: %s", server, port, strerror(errno));
-    return 1;
+
+#ifndef TCP_EPOLL
+/* Creates a UDP socket on the loopback interface that sends to itself,
+ * select() only takes sockets on windows so a pipe won't do */
+int wakeup_socket(void) {
+  struct sockaddr_in addr;
+  socklen_t length = sizeof(struct sockaddr_in);
+  int sock;
+#ifdef MBNP_mingw
+  unsigned long NonBlockMode = 1;
+#endif
+
+  if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    return -1;
+  memset((void *)&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0
+      || getsockname(sock, (struct sockaddr *)&addr, &length) < 0
+      || connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+    close(sock);
+    return -1;
   }
-  dat->conn[0].sock = dat->rconn;
-  dat->conn[0].buflen = 0;
+#ifdef MBNP_mingw
+  ioctlsocket(sock, FIONBIO, &NonBlockMode);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+  return sock;
+}
+#endif
 
-  return 0;
+
+/* Creates a socket listening at the given address, returns -1 on error */
+int listen_socket(struct addrinfo *rp, char reuseport) {
+  int sock, n = 1;
+
+  /* create socket */
+  if((sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+    return -1;
+  /* bind */
+  if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&n, sizeof(int)) >= 0
+#ifdef SO_REUSEPORT
+     && (!reuseport || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&n, sizeof(int)) >= 0)
+#else
+     && !reuseport
+#endif
+     && bind(sock, rp->ai_addr, rp->ai_addrlen) >= 0
+     && listen(sock, SOMAXCONN) >= 0) {
+#ifdef TCP_EPOLL
+    /* we accept() until there are no more pending connections */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+    return sock;
+  }
+  close(sock);
+  return -1;
 }
 
 
 int setup_server(struct tcpdat *dat, char *ip, char *port, char *err) {
   struct addrinfo hint, *res, *rp;
-  int n;
+  int i;
 
   /* lookup hostname/ip address */
   memset((void *)&hint, 0, sizeof(struct addrinfo));
@@ -192,67 +435,124 @@ int setup_server(struct tcpdat *dat, char *ip, char *port, char *err) {
     return 1;
   }
 
-  for(rp=res; rp != NULL; rp=rp->ai_next) {
-    /* create socket */
-    if((dat->listensocket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
-      continue;
-    /* bind */
-    if(setsockopt(dat->listensocket, SOL_SOCKET, SO_REUSEADDR, (void *)&n, sizeof(int)) >= 0
-       && bind(dat->listensocket, rp->ai_addr, rp->ai_addrlen) >= 0
-       && listen(dat->listensocket, 5) >= 0)
+  for(rp=res; rp != NULL; rp=rp->ai_next)
+    if((dat->shard[0].listensocket = listen_socket(rp, dat->shards > 1)) >= 0
+        || (dat->shards > 1 && (dat->shard[0].listensocket = listen_socket(rp, 0)) >= 0))
       break;
-    close(dat->listensocket);
-  }
   if(rp == NULL) {
     sprintf(err, "Can't bind to %s port %s: %s", ip, port, strerror(errno));
+    freeaddrinfo(res);
     return 1;
   }
 
+  /* With several receiver threads, each gets a listen socket of its own
+   * and the kernel spreads the connections over them. If that isn't
+   * possible, the first thread accepts and hands off the connections. */
+  for(i=1; i<dat->shards; i++)
+    if((dat->shard[i].listensocket = listen_socket(rp, 1)) < 0)
+      break;
+  if(i < dat->shards)
+    for(i=1; i<dat->shards; i++) {
+      if(dat->shard[i].listensocket >= 0)
+        close(dat->shard[i].listensocket);
+      dat->shard[i].listensocket = -1;
+    }
+  freeaddrinfo(res);
+
   return 0;
 }
 
 
 int init_tcp(struct mbn_interface *itf, char *err) {
   struct tcpdat *dat = (struct tcpdat *)itf->data;
-  int i;
+  struct tcpshard *sh;
+  int i, r;
+#ifdef TCP_EPOLL
+  struct epoll_event ev;
+#endif
 
-  if((i = pthread_create(&(dat->thread), NULL, receiver, (void *) itf)) != 0) {
-    sprintf(err, "Can't create thread: %s (%d)", strerror(i), i);
-    return 1;
+  for(i=0; i<dat->shards; i++) {
+    sh = &(dat->shard[i]);
+#ifdef TCP_EPOLL
+    /* listen socket has a NULL pointer, connections point to their struct */
+    memset((void *)&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN | EPOLLET;
+    if(sh->listensocket >= 0 && epoll_ctl(sh->epoll, EPOLL_CTL_ADD, sh->listensocket, &ev) < 0) {
+      sprintf(err, "epoll_ctl(): %s", strerror(errno));
+      return 1;
+    }
+#endif
+
+    if((r = pthread_create(&(sh->thread), NULL, receiver, (void *) sh)) != 0) {
+      sprintf(err, "Can't create thread: %s (%d)", strerror(r), r);
+      return 1;
+    }
+    sh->started = 1;
   }
   return 0;
 }
 
 
-void stop_tcp(struct mbn_interface *itf) {
-  struct tcpdat *dat = (struct tcpdat *)itf->data;
-  int i;
+/* Cancels the receiver threads, if they're running */
+void stop_receivers(struct tcpdat *dat) {
+  struct tcpshard *sh;
+  int i, j;
 
-  for(i=0; !dat->thread_run; i++) {
-    if(i > 5)
-      break;
-    sleep(1);
+  for(j=0; j<dat->shards; j++) {
+    sh = &(dat->shard[j]);
+    if(!sh->started)
+      continue;
+    for(i=0; !sh->thread_run; i++) {
+      if(i > 5)
+        break;
+      sleep(1);
+    }
+    pthread_cancel(sh->thread);
+    pthread_join(sh->thread, NULL);
+    sh->started = 0;
   }
-  pthread_cancel(dat->thread);
-  pthread_join(dat->thread, NULL);
+}
+
+
+void stop_tcp(struct mbn_interface *itf) {
+  stop_receivers((struct tcpdat *)itf->data);
 }
 
 void free_tcp(struct mbn_interface *itf) {
   struct tcpdat *dat = (struct tcpdat *)itf->data;
   int i;
 
-  for(i=0; !dat->thread_run; i++) {
-    if(i > 5)
-      break;
-    sleep(1);
-  }
-  pthread_cancel(dat->thread);
-  pthread_join(dat->thread, NULL);
-
-  for(i=0; i<MAX_CONNECTIONS; i++)
-    if(dat->conn[i].sock >= 0)
-      close(dat->conn[i].sock);
+  stop_receivers(dat);
 
+  /* still connecting to the server */
+  if(dat->rconn >= 0 && dat->conn[0]->sock != dat->rconn)
+    close(dat->rconn);
+  for(i=0; i<dat->connsize; i++) {
+    if(dat->conn[i]->sock >= 0)
+      close(dat->conn[i]->sock);
+    sendq_clear(&(dat->conn[i]->sendq));
+    pthread_mutex_destroy(&(dat->conn[i]->lock));
+    free(dat->conn[i]->buf);
+    free(dat->conn[i]);
+  }
+  for(i=0; i<dat->shards; i++) {
+    if(dat->shard[i].listensocket >= 0)
+      close(dat->shard[i].listensocket);
+#ifdef TCP_EPOLL
+    close(dat->shard[i].epoll);
+#else
+    close(dat->shard[i].wakeup);
+#endif
+  }
+  if(dat->raddr != NULL)
+    freeaddrinfo(dat->raddr);
+  free(dat->rname);
+
+  free(dat->shard);
+  free(dat->conn);
+  fwd_free(&(dat->fwd));
+  fwd_dedup_free(&(dat->dedup));
+  pthread_rwlock_destroy(&(dat->lock));
   free(dat);
   free(itf);
 #ifdef MBNP_mingw
@@ -267,118 +567,646 @@ void free_addr_tcp(struct mbn_interface *itf, void *ifaddr) {
   ifaddr = NULL;
 }
 
-void new_connection(struct mbn_interface *itf, struct tcpdat *dat) {
-  int i;
+/* Accepts a connection on the listen socket of a receiver thread, and hands
+ * it to the next thread when the others don't have a listen socket of their own.
+ * returns 0 when a connection has been accepted or rejected, 1 if there was none */
+int new_connection(struct mbn_interface *itf, struct tcpdat *dat, struct tcpshard *sh) {
+  int i, r, sock;
   struct sockaddr_in remote_addr;
   unsigned int remote_addr_length = sizeof(remote_addr);
+  struct tcpconn *cn;
+#ifdef TCP_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if((sock = accept(sh->listensocket, (struct sockaddr *)&remote_addr, &remote_addr_length)) < 0)
+    return errno == EINTR || errno == ECONNABORTED ? 0 : 1;
 
-  for(i=0; i<MAX_CONNECTIONS; i++)
-    if(dat->conn[i].sock < 0)
+  pthread_rwlock_wrlock(&(dat->lock));
+  for(i=0; i<dat->connsize; i++)
+    if(dat->conn[i]->sock < 0 && !dat->conn[i]->server)
       break;
 
-  /* MAX_CONNECTIONS reached, just close the connection */
-  if(i >= MAX_CONNECTIONS) {
-    if((i = accept(dat->listensocket, (struct sockaddr *)&remote_addr, &remote_addr_length)) > 0)
-      close(i);
+  /* MaxConnections reached, just close the connection */
+  if(i >= dat->connsize && grow_connections(itf, dat, i+1) != 0) {
+    pthread_rwlock_unlock(&(dat->lock));
+    close(sock);
     mbnWriteLogMessage(itf, "Rejected TCP connection from %s:%d", inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
-    return;
+    return 0;
   }
 
   /* accept the connection */
-  if((dat->conn[i].sock = accept(dat->listensocket, (struct sockaddr *)&remote_addr, &remote_addr_length)) < 0)
-    return;
-  dat->conn[i].buflen = 0;
-  dat->conn[i].remoteip = remote_addr.sin_addr.s_addr;
-  dat->conn[i].remoteport = remote_addr.sin_port;
+  cn = dat->conn[i];
+  cn->buflen = 0;
+  cn->remoteip = remote_addr.sin_addr.s_addr;
+  cn->remoteport = remote_addr.sin_port;
+  cn->writing = cn->closing = 0;
+#ifdef TCP_EPOLL
+  if(dat->shard[dat->shards-1].listensocket < 0) {
+    sh = &(dat->shard[dat->handoff]);
+    dat->handoff = (dat->handoff+1) % dat->shards;
+  }
+  cn->epoll = sh->epoll;
+  memset((void *)&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = (void *)cn;
+  if((r = epoll_ctl(cn->epoll, EPOLL_CTL_ADD, sock, &ev)) == 0)
+    cn->sock = sock;
+#else
+  cn->wakeup = sh->wakeup;
+  cn->sock = sock;
+  r = 0;
+#endif
+  pthread_rwlock_unlock(&(dat->lock));
+  if(r < 0) {
+    close(sock);
+    mbnWriteLogMessage(itf, "Couldn't add TCP connection from %s:%d: %s", inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port), strerror(errno));
+    return 0;
+  }
 
   mbnWriteLogMessage(itf, "Accepted TCP connection from %s:%d", inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+  return 0;
 }
 
 
-int read_connection(struct mbn_interface *itf, struct tcpconn *cn, char *err) {
-  struct tcpdat *dat = (struct tcpdat *)itf->data;
-  unsigned char buf[BUFFERSIZE];
-  int n, i, j;
-  struct in_addr remote_addr;
-
-  n = recv(cn->sock, (char *)buf, BUFFERSIZE, 0);
-  if(n < 0 && errno == EINTR)
-    return 0;
+/* Forwards a message received on one connection to all others */
+void forward_all(struct mbn_interface *itf, struct tcpdat *dat, struct tcpconn *cn, unsigned char *buf, int length) {
+  int i;
 
-  /* error, close connection */
-  if(n <= 0) {
-    close(cn->sock);
-    /* oops, this was our remote connection, we shouldn't lose this one! */
-    if(dat->rconn == cn->sock) {
-      mbnWriteLogMessage(itf, "Lost connection to server");
-      sprintf(err, "Lost connection to server");
-      return 1;
+  pthread_rwlock_rdlock(&(dat->lock));
+  for(i=0; i<dat->connsize; i++)
+    if((dat->conn[i]->sock >= 0 || dat->conn[i]->server) && dat->conn[i] != cn) {
+      pthread_mutex_lock(&(dat->conn[i]->lock));
+      transmit_connection(itf, dat->conn[i], buf, length);
+      pthread_mutex_unlock(&(dat->conn[i]->lock));
     }
-    cn->sock = -1;
-    remote_addr.s_addr = cn->remoteip;
-    mbnWriteLogMessage(itf, "Closed connection from %s:%d", inet_ntoa(remote_addr), ntohs(cn->remoteport));
-    cn->remoteip = 0;
-    cn->remoteport = 0;
-    return 0;
+  pthread_rwlock_unlock(&(dat->lock));
+}
+
+
+/* Switches a unicast message to the connection its destination was last
+ * seen on, or floods it if the destination isn't known. Messages for our
+ * own nodes, or for a node on the connection it came from, stay here. */
+void forward_unicast(struct mbn_interface *itf, struct tcpdat *dat, struct tcpconn *cn, unsigned char *buf, int length) {
+  struct tcpconn *to = (struct tcpconn *)fwd_lookup(&(dat->fwd), FWD_ADDRESS_TO(buf));
+
+  if(to == NULL) {
+    forward_all(itf, dat, cn, buf, length);
+    return;
   }
+  if(to == cn || (void *)to == (void *)dat)
+    return;
+  pthread_mutex_lock(&(to->lock));
+  transmit_connection(itf, to, buf, length);
+  pthread_mutex_unlock(&(to->lock));
+}
+
+
+/* Processes the complete frames in the receive buffer of a connection
+ * right where they are, and moves the start of an incomplete frame to
+ * the start of the buffer, so the next recv() appends to it */
+void frame_connection(struct mbn_interface *itf, struct tcpdat *dat, struct tcpconn *cn, int length) {
+  unsigned char *buf = cn->buf;
+  int i, start = cn->buflen > 0 ? 0 : -1;
 
-  /* handle the data */
-  for(i=0; i<n; i++) {
-    if(cn->buflen == 0 && !(buf[i] >= 0x80 && buf[i] < 0xFF))
+  for(i=cn->buflen; i<length; i++) {
+    /* ignore non-start bytes if we haven't started yet */
+    if(start < 0) {
+      if(buf[i] >= 0x80 && buf[i] < 0xFF)
+        start = i;
       continue;
-    cn->buf[cn->buflen++] = buf[i];
+    }
     if(buf[i] == 0xFF) {
-      if(cn->buflen >= MBN_MIN_MESSAGE_SIZE) {
-        /* broadcast message, forward to the other connections */
-        /* TODO: this can block the thread, use a send buffer? */
-        if(buf[0] == 0x81) {
-          for(j=0; j<MAX_CONNECTIONS; j++)
-            if(dat->conn[j].sock >= 0 && &(dat->conn[j]) != cn) {
-              tcptransmit(itf, cn->buf, cn->buflen, (void *)&(dat->conn[j]), err);
-            }
+      if(i-start+1 >= MBN_MIN_MESSAGE_SIZE) {
+        /* drop broadcasts we've just seen (or sent) */
+        if(buf[start] == 0x81 && fwd_duplicate(itf, &(dat->dedup), buf+start, i-start+1, (void *)cn)) {
+          start = -1;
+          continue;
         }
+        /* learn where the sender is, and forward broadcasts to
+         * the other connections and unicasts to where they belong */
+        fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(buf+start), (void *)cn);
+        if(buf[start] == 0x81)
+          forward_all(itf, dat, cn, buf+start, i-start+1);
+        else
+          forward_unicast(itf, dat, cn, buf+start, i-start+1);
         /* now send to mbn */
-        mbnProcessRawMessage(itf, cn->buf, cn->buflen, (void *)cn);
+        mbnProcessRawMessage(itf, buf+start, i-start+1, (void *)cn);
+      }
+      start = -1;
+    /* message was way too long, ignore it */
+    } else if(i-start+1 >= MBN_MAX_MESSAGE_SIZE)
+      start = -1;
+  }
+
+  cn->buflen = start < 0 ? 0 : length-start;
+  if(start > 0)
+    memmove((void *)buf, (void *)(buf+start), cn->buflen);
+}
+
+
+void read_connection(struct mbn_interface *itf, struct tcpconn *cn) {
+  struct tcpdat *dat = (struct tcpdat *)itf->data;
+  int n;
+  struct in_addr remote_addr;
+  unsigned short remote_port;
+
+  /* with epoll we're edge-triggered, so keep reading until there's nothing left */
+  while(1) {
+    n = recv(cn->sock, (char *)cn->buf+cn->buflen, itf->config.BufferSize-cn->buflen, RECV_FLAGS);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+
+    /* error, close connection */
+    if(n <= 0) {
+      fwd_forget(&(dat->fwd), (void *)cn);
+      pthread_mutex_lock(&(cn->lock));
+      close(cn->sock);
+      /* our connection to the server, keep the queued frames and reconnect */
+      if(cn->server) {
+        server_lost(itf, dat);
+        return;
       }
-      cn->buflen = 0;
+      sendq_clear(&(cn->sendq));
+      remote_addr.s_addr = cn->remoteip;
+      remote_port = cn->remoteport;
+      cn->remoteip = 0;
+      cn->remoteport = 0;
+      cn->sock = -1;
+      pthread_mutex_unlock(&(cn->lock));
+      mbnWriteLogMessage(itf, "Closed connection from %s:%d", inet_ntoa(remote_addr), ntohs(remote_port));
+      return;
+    }
+
+    /* handle the data */
+    frame_connection(itf, dat, cn, cn->buflen+n);
+#ifndef TCP_EPOLL
+    /* select() will tell us when there's more */
+    return;
+#endif
+  }
+}
+
+
+/* Sends as much as possible without blocking,
+ * returns the number of bytes sent or -1 on error */
+int send_nonblock(int sock, unsigned char *buf, int length) {
+  int n;
+#ifdef MBNP_mingw
+  unsigned long NonBlockMode = 1;
+
+  ioctlsocket(sock, FIONBIO, &NonBlockMode);
+  n = send(sock, (char *)buf, length, 0);
+  if(n < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+    n = 0;
+  NonBlockMode = 0;
+  ioctlsocket(sock, FIONBIO, &NonBlockMode);
+#else
+  while((n = send(sock, (char *)buf, length, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    n = 0;
+#endif
+  return n;
+}
+
+
+/* (un)registers interest in the writability of a connection, with
+ * select() the receiver is woken up to add it to the write set.
+ * cn->lock should be locked */
+void watch_writable(struct tcpconn *cn, char on) {
+#ifdef TCP_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if(cn->writing == on)
+    return;
+  cn->writing = on;
+#ifdef TCP_EPOLL
+  memset((void *)&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0);
+  ev.data.ptr = (void *)cn;
+  epoll_ctl(cn->epoll, EPOLL_CTL_MOD, cn->sock, &ev);
+#else
+  if(on)
+    send(cn->wakeup, "", 1, 0);
+#endif
+}
+
+
+/* Shuts down a connection from the transmitting side, the receiver
+ * notices this and closes it. cn->lock should be locked */
+void disconnect_connection(struct tcpconn *cn) {
+  if(cn->closing)
+    return;
+  cn->closing = 1;
+#ifdef MBNP_mingw
+  shutdown(cn->sock, SD_BOTH);
+#else
+  shutdown(cn->sock, SHUT_RDWR);
+#endif
+  sendq_clear(&(cn->sendq));
+}
+
+
+/* Queues (the rest of) a frame that couldn't be sent right away,
+ * cn->lock should be locked */
+void queue_frame(struct mbn_interface *itf, struct tcpconn *cn, unsigned char *buf, int length, int done) {
+  struct in_addr remote_addr;
+  char congested = cn->sendq.congested;
+  int r;
+
+  r = sendq_push(&(cn->sendq), buf, length, done);
+  remote_addr.s_addr = cn->remoteip;
+  /* not connected to the server at the moment, nothing to disconnect */
+  if(r == SENDQ_DISCONNECT && cn->sock < 0) {
+    cn->sendq.dropped++;
+    return;
+  }
+  if(r == SENDQ_DISCONNECT) {
+    mbnWriteLogMessage(itf, "Disconnecting slow TCP connection %s:%d (%d bytes queued)", inet_ntoa(remote_addr), ntohs(cn->remoteport), cn->sendq.length);
+    disconnect_connection(cn);
+    return;
+  }
+  if(!congested && cn->sendq.congested)
+    mbnWriteLogMessage(itf, "TCP connection %s:%d congested (%d bytes queued)", inet_ntoa(remote_addr), ntohs(cn->remoteport), cn->sendq.length);
+  if(cn->sock >= 0 && cn->sendq.length > 0)
+    watch_writable(cn, 1);
+}
+
+
+/* Transmits a frame on a connection, or queues it when the socket
+ * isn't writable. cn->lock should be locked */
+void transmit_connection(struct mbn_interface *itf, struct tcpconn *cn, unsigned char *buf, int length) {
+  int n = 0;
+
+  /* closed by its receiver in the mean time */
+  if(cn->closing || (cn->sock < 0 && !cn->server))
+    return;
+
+  /* nothing queued, try to send it right away */
+  if(cn->sock >= 0 && cn->sendq.length == 0) {
+    if((n = send_nonblock(cn->sock, buf, length)) < 0) {
+      disconnect_connection(cn);
+      return;
+    }
+    if(n == length) {
+      cn->sendq.sent++;
+      return;
     }
-    if(cn->buflen >= MBN_MAX_MESSAGE_SIZE)
-      cn->buflen = 0;
   }
+  queue_frame(itf, cn, buf, length, n);
+}
+
+
+/* Same as above for all frames of a batch that go to this connection,
+ * written with a single sendmsg() where possible */
+void transmit_connection_batch(struct mbn_interface *itf, struct tcpconn *cn, struct mbn_txframe *frames, int count) {
+#ifdef MBNP_mingw
+  int i;
+
+  for(i=0; i<count; i++)
+    if(frames[i].ifaddr == NULL || frames[i].ifaddr == (void *)cn)
+      transmit_connection(itf, cn, frames[i].buffer, frames[i].length);
+#else
+  struct iovec iov[MBN_TX_BATCH];
+  struct msghdr msg;
+  int i, n = 0, cnt = 0;
+
+  if(cn->closing || (cn->sock < 0 && !cn->server))
+    return;
+
+  for(i=0; i<count && cnt<MBN_TX_BATCH; i++)
+    if(frames[i].ifaddr == NULL || frames[i].ifaddr == (void *)cn) {
+      iov[cnt].iov_base = (void *)frames[i].buffer;
+      iov[cnt++].iov_len = frames[i].length;
+    }
+  if(cnt == 0)
+    return;
+
+  /* nothing queued, try to send it right away */
+  if(cn->sock >= 0 && cn->sendq.length == 0) {
+    memset((void *)&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    while((n = sendmsg(cn->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      disconnect_connection(cn);
+      return;
+    }
+    if(n < 0)
+      n = 0;
+  }
+
+  /* queue what's left */
+  for(i=0; i<cnt && !cn->closing; i++) {
+    if(n >= (int)iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      cn->sendq.sent++;
+      continue;
+    }
+    queue_frame(itf, cn, (unsigned char *)iov[i].iov_base, iov[i].iov_len, n);
+    n = 0;
+  }
+#endif
+}
+
+
+/* Writes out the send queue of a connection, called when it's writable */
+void flush_connection(struct tcpconn *cn) {
+  unsigned char *buf;
+  int n, r;
+
+  pthread_mutex_lock(&(cn->lock));
+  while(!cn->closing && (n = sendq_peek(&(cn->sendq), &buf)) > 0) {
+    if((r = send_nonblock(cn->sock, buf, n)) < 0)
+      disconnect_connection(cn);
+    if(r <= 0)
+      break;
+    sendq_consume(&(cn->sendq), r);
+  }
+  if(cn->closing || cn->sendq.length == 0)
+    watch_writable(cn, 0);
+  pthread_mutex_unlock(&(cn->lock));
+}
+
+
+/* Switches a socket between blocking and non-blocking mode */
+void set_nonblock(int sock, char on) {
+#ifdef MBNP_mingw
+  unsigned long NonBlockMode = on;
+
+  ioctlsocket(sock, FIONBIO, &NonBlockMode);
+#else
+  int flags = fcntl(sock, F_GETFL);
+
+  fcntl(sock, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
+
+/* Starts a connection attempt to the next address of the server,
+ * returns 0 if the attempt is in progress */
+int connect_server(struct mbn_interface *itf, struct tcpdat *dat, char *err) {
+  struct addrinfo *rp = dat->rtry != NULL ? dat->rtry : dat->raddr;
+  int r;
+#ifdef TCP_EPOLL
+  struct epoll_event ev;
+#endif
+
+  dat->rtry = rp->ai_next;
+  if((dat->rconn = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0) {
+    sprintf(err, "socket(): %s", strerror(errno));
+    return 1;
+  }
+  set_nonblock(dat->rconn, 1);
+  r = connect(dat->rconn, rp->ai_addr, rp->ai_addrlen);
+#ifdef MBNP_mingw
+  if(r < 0 && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+  if(r < 0 && errno != EINPROGRESS) {
+#endif
+    sprintf(err, "%s", strerror(errno));
+    close(dat->rconn);
+    dat->rconn = -1;
+    return 1;
+  }
+
+#ifdef TCP_EPOLL
+  /* a connection attempt has a pointer to dat, the socket
+   * becomes writable when the attempt has finished */
+  memset((void *)&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLOUT;
+  ev.data.ptr = (void *)dat;
+  if(epoll_ctl(dat->shard[0].epoll, EPOLL_CTL_ADD, dat->rconn, &ev) < 0) {
+    sprintf(err, "epoll_ctl(): %s", strerror(errno));
+    close(dat->rconn);
+    dat->rconn = -1;
+    return 1;
+  }
+#endif
+  dat->rtime = monotonic_ms()+itf->config.ConnectTimeout;
   return 0;
 }
 
 
+/* Gives up on the current connection attempt, and schedules the next one:
+ * right away for the next address of the server, or after a delay that
+ * doubles with every failed attempt (spread a bit, so that a lot of
+ * clients don't all reconnect at the same moment) */
+void connect_failed(struct mbn_interface *itf, struct tcpdat *dat, char *reason) {
+  int delay = 0;
+
+  if(dat->rconn >= 0)
+    close(dat->rconn);
+  dat->rconn = -1;
+
+  if(dat->rtry == NULL) {
+    delay = dat->rdelay/2 + rand()%(dat->rdelay/2+1);
+    dat->rdelay = MIN(dat->rdelay*2, itf->config.ReconnectMaxDelay);
+  }
+  dat->rtime = monotonic_ms()+delay;
+  mbnWriteLogMessage(itf, "Couldn't connect to %s: %s, retrying in %d ms", dat->rname, reason, delay);
+}
+
+
+/* Called when a connection attempt has finished (with or without success) */
+void finish_connect(struct mbn_interface *itf, struct tcpdat *dat) {
+  struct tcpconn *cn = dat->conn[0];
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(int);
+  int e = 0;
+#ifdef TCP_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if(getsockopt(dat->rconn, SOL_SOCKET, SO_ERROR, (char *)&e, &len) < 0)
+    e = errno;
+  if(e != 0) {
+    connect_failed(itf, dat, strerror(e));
+    return;
+  }
+  set_nonblock(dat->rconn, 0);
+
+  pthread_mutex_lock(&(cn->lock));
+  len = sizeof(struct sockaddr_in);
+  memset((void *)&addr, 0, sizeof(struct sockaddr_in));
+  getpeername(dat->rconn, (struct sockaddr *)&addr, &len);
+  cn->remoteip = addr.sin_family == AF_INET ? addr.sin_addr.s_addr : 0;
+  cn->remoteport = addr.sin_family == AF_INET ? addr.sin_port : 0;
+  cn->buflen = 0;
+  cn->writing = cn->closing = 0;
+  /* the frames queued in the mean time go out first */
+  sendq_restart(&(cn->sendq));
+#ifdef TCP_EPOLL
+  memset((void *)&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = (void *)cn;
+  epoll_ctl(cn->epoll, EPOLL_CTL_MOD, dat->rconn, &ev);
+#endif
+  cn->sock = dat->rconn;
+  if(cn->sendq.length > 0)
+    watch_writable(cn, 1);
+  pthread_mutex_unlock(&(cn->lock));
+
+  dat->rtry = NULL;
+  dat->rdelay = itf->config.ReconnectDelay;
+  dat->rstate = MBN_CONNECTION_UP;
+  mbnWriteLogMessage(itf, "Connected to %s", dat->rname);
+  mbnInterfaceConnectionState(itf, (void *)cn, MBN_CONNECTION_UP);
+}
+
+
+/* Called by the receiver when the connection to the server has been
+ * closed, cn->lock should be locked (and is unlocked) */
+void server_lost(struct mbn_interface *itf, struct tcpdat *dat) {
+  struct tcpconn *cn = dat->conn[0];
+
+  cn->sock = dat->rconn = -1;
+  cn->buflen = 0;
+  cn->writing = cn->closing = 0;
+  pthread_mutex_unlock(&(cn->lock));
+
+  /* reconnect right away, the delays only start after a failed attempt */
+  dat->rstate = MBN_CONNECTION_DOWN;
+  dat->rtime = monotonic_ms();
+  mbnWriteLogMessage(itf, "Lost connection to %s", dat->rname);
+  mbnInterfaceConnectionState(itf, (void *)cn, MBN_CONNECTION_DOWN);
+}
+
+
+/* Starts a new attempt to connect to the server when it's time to, or
+ * gives up on an attempt that takes too long. Returns the number of
+ * milliseconds until it has to be called again. */
+int check_server(struct mbn_interface *itf, struct tcpdat *dat) {
+  char err[MBN_ERRSIZE];
+  unsigned long now;
+
+  if(dat->raddr == NULL || dat->rstate == MBN_CONNECTION_UP)
+    return 1000;
+
+  while((long)(dat->rtime-(now = monotonic_ms())) <= 0) {
+    if(dat->rconn >= 0) {
+      connect_failed(itf, dat, "timed out");
+      continue;
+    }
+    if(dat->rstate == MBN_CONNECTION_DOWN) {
+      dat->rstate = MBN_CONNECTION_CONNECTING;
+      mbnInterfaceConnectionState(itf, (void *)dat->conn[0], MBN_CONNECTION_CONNECTING);
+    }
+    if(connect_server(itf, dat, err) != 0)
+      connect_failed(itf, dat, err);
+  }
+  return (int)(dat->rtime-now);
+}
+
+
+#ifdef TCP_EPOLL
+
+void *receiver(void *ptr) {
+  struct tcpshard *sh = (struct tcpshard *)ptr;
+  struct mbn_interface *itf = sh->itf;
+  struct tcpdat *dat = (struct tcpdat *)itf->data;
+  struct epoll_event ev[EPOLLEVENTS];
+  struct tcpconn *cn;
+  char err[MBN_ERRSIZE];
+  int n, i, state;
+
+  sh->thread_run = 1;
+
+  while(1) {
+    pthread_testcancel();
+
+    /* wait for events, or until the next (re)connection attempt is due,
+     * the connection to the server is handled by the first thread */
+    n = epoll_wait(sh->epoll, ev, EPOLLEVENTS, sh == dat->shard ? MIN(check_server(itf, dat), 1000) : 1000);
+    if(n == 0 || (n < 0 && errno == EINTR))
+      continue;
+    if(n < 0) {
+      sprintf(err, "Couldn't wait for events: %s", strerror(errno));
+      mbnInterfaceReadError(itf, err);
+      break;
+    }
+
+    /* don't get cancelled while holding a lock another thread may be waiting for */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    for(i=0; i<n; i++) {
+      /* incoming connections */
+      if(ev[i].data.ptr == NULL) {
+        while(new_connection(itf, dat, sh) == 0)
+          ;
+        continue;
+      }
+      /* connection attempt to the server has finished */
+      if(ev[i].data.ptr == (void *)dat) {
+        if(dat->rconn >= 0)
+          finish_connect(itf, dat);
+        continue;
+      }
+      cn = (struct tcpconn *)ev[i].data.ptr;
+      /* room for queued data */
+      if(cn->sock >= 0 && ev[i].events & EPOLLOUT)
+        flush_connection(cn);
+      /* data (or a closed connection) */
+      if(cn->sock >= 0 && ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        read_connection(itf, cn);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+  }
+  return NULL;
+}
+
+#else
+
 void *receiver(void *ptr) {
-  struct mbn_interface *itf = (struct mbn_interface *)ptr;
+  struct tcpshard *sh = (struct tcpshard *)ptr;
+  struct mbn_interface *itf = sh->itf;
   struct tcpdat *dat = (struct tcpdat *)itf->data;
   char err[MBN_ERRSIZE];
+  char drain[64];
   struct timeval tv;
-  fd_set rdfd;
-  int n, i;
+  fd_set rdfd, wrfd, exfd;
+  int n, i, t, state;
 
-  dat->thread_run = 1;
+  sh->thread_run = 1;
 
   while(1) {
     pthread_testcancel();
 
     /* select file descriptors */
+    t = MIN(check_server(itf, dat), 1000);
     FD_ZERO(&rdfd);
-    n = 0;
-    if(dat->listensocket >= 0) {
-      FD_SET(dat->listensocket, &rdfd);
-      n = MAX(n, dat->listensocket);
+    FD_ZERO(&wrfd);
+    FD_ZERO(&exfd);
+    FD_SET(sh->wakeup, &rdfd);
+    n = sh->wakeup;
+    /* connection attempt in progress (failures are reported in exfd on windows) */
+    if(dat->rstate == MBN_CONNECTION_CONNECTING && dat->rconn >= 0) {
+      FD_SET(dat->rconn, &wrfd);
+      FD_SET(dat->rconn, &exfd);
+      n = MAX(n, dat->rconn);
     }
-    for(i=0; i<MAX_CONNECTIONS; i++)
-      if(dat->conn[i].sock >= 0) {
-        FD_SET(dat->conn[i].sock, &rdfd);
-        n = MAX(n, dat->conn[i].sock);
+    if(sh->listensocket >= 0) {
+      FD_SET(sh->listensocket, &rdfd);
+      n = MAX(n, sh->listensocket);
+    }
+    pthread_rwlock_rdlock(&(dat->lock));
+    for(i=0; i<dat->connsize; i++)
+      if(dat->conn[i]->sock >= 0) {
+        FD_SET(dat->conn[i]->sock, &rdfd);
+        if(dat->conn[i]->writing)
+          FD_SET(dat->conn[i]->sock, &wrfd);
+        n = MAX(n, dat->conn[i]->sock);
       }
+    pthread_rwlock_unlock(&(dat->lock));
 
-    /* wait for readable sockets */
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    n = select(n+1, &rdfd, NULL, NULL, &tv);
+    /* wait for readable sockets, or for writable ones with queued data */
+    tv.tv_sec = t/1000;
+    tv.tv_usec = (t%1000)*1000;
+    n = select(n+1, &rdfd, &wrfd, &exfd, &tv);
     if(n == 0 || (n < 0 && errno == EINTR))
       continue;
     if(n < 0) {
@@ -387,46 +1215,123 @@ void *receiver(void *ptr) {
       break;
     }
 
-    /* check for incoming connections */
-    if(dat->listensocket >= 0 && FD_ISSET(dat->listensocket, &rdfd))
-      new_connection(itf, dat);
+    /* the send queues are checked on every round anyway */
+    if(FD_ISSET(sh->wakeup, &rdfd))
+      while(recv(sh->wakeup, drain, sizeof(drain), 0) > 0)
+        ;
 
-    /* check for data on all connections */
-    for(i=0; i<MAX_CONNECTIONS; i++)
-      if(dat->conn[i].sock >=0 && FD_ISSET(dat->conn[i].sock, &rdfd))
-        if(read_connection(itf, &(dat->conn[i]), err))
-          mbnInterfaceReadError(itf, err);
+    /* don't get cancelled while holding a lock another thread may be waiting for */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+    /* write queued data and check for data on all connections */
+    for(i=0; i<dat->connsize; i++) {
+      if(dat->conn[i]->sock >= 0 && FD_ISSET(dat->conn[i]->sock, &wrfd))
+        flush_connection(dat->conn[i]);
+      if(dat->conn[i]->sock >=0 && FD_ISSET(dat->conn[i]->sock, &rdfd))
+        read_connection(itf, dat->conn[i]);
+    }
+
+    /* check for incoming connections */
+    if(sh->listensocket >= 0 && FD_ISSET(sh->listensocket, &rdfd))
+      new_connection(itf, dat, sh);
+
+    /* connection attempt to the server has finished */
+    if(dat->rstate == MBN_CONNECTION_CONNECTING && dat->rconn >= 0
+        && (FD_ISSET(dat->rconn, &wrfd) || FD_ISSET(dat->rconn, &exfd)))
+      finish_connect(itf, dat);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
   }
   return NULL;
 }
 
+#endif
+
 
 int tcptransmit(struct mbn_interface *itf, unsigned char *buf, int length, void *ifaddr, char *err) {
   struct tcpconn *cn = (struct tcpconn *)ifaddr;
   struct tcpdat *dat = (struct tcpdat *)itf->data;
   int i;
-#ifdef MBNP_mingw
-  unsigned long NonBlockMode;
-#endif
 
-  for(i=0; i<MAX_CONNECTIONS; i++) {
-    if(dat->conn[i].sock < 0 || (cn != NULL && cn != &(dat->conn[i])))
-      continue;
+  /* messages from our own nodes aren't forwarded back to us */
+  fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(buf), (void *)dat);
+  if(buf[0] == 0x81)
+    fwd_remember(&(dat->dedup), buf, length);
 
-#ifdef MBNP_mingw
-    NonBlockMode=1;
-    ioctlsocket(dat->conn[i].sock, FIONBIO,&NonBlockMode);
+  if(cn != NULL) {
+    pthread_mutex_lock(&(cn->lock));
+    transmit_connection(itf, cn, buf, length);
+    pthread_mutex_unlock(&(cn->lock));
+    return 0;
+  }
 
-    send(dat->conn[i].sock, (char *)buf, length, 0);
+  pthread_rwlock_rdlock(&(dat->lock));
+  for(i=0; i<dat->connsize; i++)
+    if(dat->conn[i]->sock >= 0 || dat->conn[i]->server) {
+      pthread_mutex_lock(&(dat->conn[i]->lock));
+      transmit_connection(itf, dat->conn[i], buf, length);
+      pthread_mutex_unlock(&(dat->conn[i]->lock));
+    }
+  pthread_rwlock_unlock(&(dat->lock));
+  return 0;
+  err = NULL;
+}
 
-    NonBlockMode=0;
-    ioctlsocket(dat->conn[i].sock, FIONBIO,&NonBlockMode);
-#else
-    send(dat->conn[i].sock, (char *)buf, length, MSG_DONTWAIT);
-#endif
+
+int tcptransmit_batch(struct mbn_interface *itf, struct mbn_txframe *frames, int count, char *err) {
+  struct tcpdat *dat = (struct tcpdat *)itf->data;
+  struct tcpconn *cn;
+  int i, j;
+
+  for(i=0; i<count; i++) {
+    fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(frames[i].buffer), (void *)dat);
+    if(frames[i].buffer[0] == 0x81)
+      fwd_remember(&(dat->dedup), frames[i].buffer, frames[i].length);
   }
+
+  pthread_rwlock_rdlock(&(dat->lock));
+  /* any broadcasts? then every connection gets something */
+  for(i=0; i<count; i++)
+    if(frames[i].ifaddr == NULL)
+      break;
+  if(i < count) {
+    for(i=0; i<dat->connsize; i++)
+      if(dat->conn[i]->sock >= 0 || dat->conn[i]->server) {
+        pthread_mutex_lock(&(dat->conn[i]->lock));
+        transmit_connection_batch(itf, dat->conn[i], frames, count);
+        pthread_mutex_unlock(&(dat->conn[i]->lock));
+      }
+  } else {
+    /* otherwise, only the connections we have frames for */
+    for(i=0; i<count; i++) {
+      for(j=0; j<i; j++)
+        if(frames[j].ifaddr == frames[i].ifaddr)
+          break;
+      cn = (struct tcpconn *)frames[i].ifaddr;
+      if(j == i && (cn->sock >= 0 || cn->server)) {
+        pthread_mutex_lock(&(cn->lock));
+        transmit_connection_batch(itf, cn, frames+i, count-i);
+        pthread_mutex_unlock(&(cn->lock));
+      }
+    }
+  }
+  pthread_rwlock_unlock(&(dat->lock));
   return 0;
   err = NULL;
 }
 
 
+int queue_status_tcp(struct mbn_interface *itf, void *ifaddr, struct mbn_queue_status *status) {
+  struct tcpconn *cn = (struct tcpconn *)ifaddr;
+  int r = 1;
+
+  if(cn == NULL)
+    return r;
+  pthread_mutex_lock(&(cn->lock));
+  if(cn->sock >= 0 || cn->server) {
+    sendq_status(&(cn->sendq), status);
+    r = 0;
+  }
+  pthread_mutex_unlock(&(cn->lock));
+  return r;
+  itf = NULL;
+}
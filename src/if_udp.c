@@ -14,6 +14,7 @@
 **
 ****************************************************************************/
 
+#define _GNU_SOURCE /* sendmmsg() */
 #define _XOPEN_SOURCE 600
 #define _XOPEN_SOURCE_EXTENDED 1
 
@@ -41,6 +42,9 @@
 #endif
 #include <pthread.h>
 
+#include "fwdtable.h"
+#include "address.h"
+
 /* sleep() */
 #ifdef MBNP_mingw
 # include <windows.h>
@@ -51,21 +55,68 @@
 
 
 #define MBN_UDP_PORT "34848"
-#define BUFFERSIZE 512
+/* defaults for the interface configuration */
+#define BUFFERSIZE 1472 /* largest datagram that isn't fragmented on ethernet */
 #define ADDLSTSIZE 1000 /* assume we don't have more than 1000 nodes on UDP connections */
+#define PEERTIMEOUT 300 /* seconds after which a peer that hasn't sent anything is forgotten */
+#define DUPLICATEWINDOW 100 /* milliseconds a broadcast is remembered, to drop its copies */
+#define BATCHSIZE 64 /* datagrams received or sent with one system call */
+#define PACKETSIZE -1 /* one frame per datagram, for nodes that only read the first */
+#define SELFSENT 256 /* datagrams sent to the multicast group that we recognize when they loop back */
 
+/* peer, the ifaddr of the frames it sent */
 struct udpaddr {
-  unsigned long addr;
+  unsigned long addr; /* 0 if unused */
   unsigned short port;
+  unsigned long seen; /* monotonic_ms() */
+  int next; /* next peer in the same bucket or in the free list, -1 at the end */
+  int active; /* index in the active list */
+  char used; /* handed to the library, until udp_free_addr() */
+};
+
+/* spread the address and port of a peer over the buckets */
+#define UDP_HASH(d, a, p) (((((a) ^ ((unsigned long)(p)<<16)) * 2654435761UL) >> 12) & ((d)->buckets-1))
+
+#ifdef MBNP_linux
+/* datagrams for sendmmsg() or from recvmmsg() */
+struct udpbatch {
+  struct mmsghdr *msg;
+  struct iovec *iov;
+  struct sockaddr_in *addr;
+  int count, size;
 };
+#endif
 
 struct udpdat {
   int socket;
   char thread_run;
   unsigned long defaultaddr;
   unsigned short defaultport;
-  struct udpaddr addr[ADDLSTSIZE];
+  char multicast; /* defaultaddr is a multicast group we joined */
+  /* source of our own datagrams, which the group loops back to us, and
+   * hashes of the last ones, as other interfaces on this host that listen
+   * to the group come from the same address and port */
+  unsigned long selfaddr;
+  unsigned short selfport;
+  unsigned long selfsent[SELFSENT];
+  int selfnext;
+  /* peer table, AddressListSize entries chained per bucket of a hash on
+   * address and port, plus a list of the ones in use to send broadcasts */
+  struct udpaddr *addr;
+  int *bucket, buckets, free;
+  int *active, count;
+  unsigned long aged; /* monotonic_ms() of the last check for idle peers */
+  pthread_mutex_t peerlock;
+  unsigned char *buffer;
   pthread_t thread;
+  struct fwd_dedup dedup;
+#ifdef MBNP_linux
+  /* received datagrams (in buffer), broadcasts forwarded by the receiver
+   * thread, and frames sent by the library (locked with txlock) */
+  struct udpbatch rx, fw, tx;
+  struct iovec pack[MBN_TX_BATCH]; /* frames of the datagrams in tx */
+  pthread_mutex_t txlock;
+#endif
 };
 
 int udp_init(struct mbn_interface *, char *);
@@ -73,16 +124,37 @@ void *udp_receive_packets(void *);
 void udp_stop(struct mbn_interface *);
 void udp_free(struct mbn_interface *);
 void udp_free_addr(struct mbn_interface *, void *);
+void udp_remove_peer(struct mbn_interface *, struct udpdat *, int);
+void udp_age_peers(struct mbn_interface *, struct udpdat *, unsigned long);
+unsigned long udp_hash(unsigned long, unsigned char *, int);
+void udp_sent_group(struct udpdat *, unsigned long);
+int udp_own_datagram(struct udpdat *, unsigned char *, int, struct sockaddr_in *);
 int udp_transmit(struct mbn_interface *, unsigned char *, int, void *, char *);
+int udp_transmit_batch(struct mbn_interface *, struct mbn_txframe *, int, char *);
+#ifdef MBNP_linux
+void udp_batch_init(struct udpbatch *, int);
+void udp_batch_free(struct udpbatch *);
+int udp_flush_batch(struct udpdat *, struct udpbatch *, char *);
+int udp_batch_add(struct udpdat *, struct udpbatch *, unsigned char *, int, unsigned long, unsigned short, char *);
+int udp_batch_addv(struct udpdat *, struct udpbatch *, struct iovec *, int, unsigned long, unsigned short, char *);
+#endif
 
 
 struct mbn_interface * MBN_EXPORT mbnUDPOpen(char *remotehost, char *remoteport, char *localport, char *err) {
+  return mbnUDPOpenConfig(remotehost, remoteport, localport, NULL, err);
+}
+
+
+struct mbn_interface * MBN_EXPORT mbnUDPOpenConfig(char *remotehost, char *remoteport, char *localport, struct mbn_if_config *config, char *err) {
   struct udpdat *data;
   struct mbn_interface *itf;
   int error = 0;
   struct sockaddr_in si_me;
   struct hostent *remoteserver;
-  int port;
+  struct ip_mreq mreq;
+  socklen_t addrlength;
+  int port, i, s;
+  int reuse = 1;
 
   /* Why the hell is this call _required_?
    * Why doesn't Microsoft just support plain BSD sockets? */
@@ -95,7 +167,47 @@ struct mbn_interface * MBN_EXPORT mbnUDPOpen(char *remotehost, char *remoteport,
 #endif
 
   itf = (struct mbn_interface *) calloc(1, sizeof(struct mbn_interface));
+  itf->config.BufferSize = BUFFERSIZE;
+  itf->config.AddressListSize = ADDLSTSIZE;
+  itf->config.ForwardTimeout = PEERTIMEOUT;
+  itf->config.DuplicateWindow = DUPLICATEWINDOW;
+  itf->config.BatchSize = BATCHSIZE;
+  itf->config.PacketSize = PACKETSIZE;
+  if(mbnInterfaceConfig(itf, config, err) != 0) {
+    free(itf);
+#ifdef MBNP_mingw
+    WSACleanup();
+#endif
+    return NULL;
+  }
   data = (struct udpdat *) calloc(1, sizeof(struct udpdat));
+  data->addr = (struct udpaddr *) calloc(itf->config.AddressListSize, sizeof(struct udpaddr));
+  data->active = (int *) malloc(itf->config.AddressListSize*sizeof(int));
+  for(data->buckets=16; data->buckets < itf->config.AddressListSize; data->buckets *= 2)
+    ;
+  data->bucket = (int *) malloc(data->buckets*sizeof(int));
+  for(i=0; i<data->buckets; i++)
+    data->bucket[i] = -1;
+  for(i=0; i<itf->config.AddressListSize; i++)
+    data->addr[i].next = i+1 < itf->config.AddressListSize ? i+1 : -1;
+  data->free = itf->config.AddressListSize > 0 ? 0 : -1;
+  data->aged = monotonic_ms();
+  pthread_mutex_init(&(data->peerlock), NULL);
+  fwd_dedup_init(&(data->dedup), itf->config.DuplicateWindow);
+#ifdef MBNP_linux
+  /* a receive buffer for every datagram of a batch */
+  data->buffer = (unsigned char *) malloc(itf->config.BatchSize*itf->config.BufferSize);
+  udp_batch_init(&(data->rx), itf->config.BatchSize);
+  udp_batch_init(&(data->fw), itf->config.BatchSize);
+  udp_batch_init(&(data->tx), itf->config.BatchSize);
+  for(i=0; i<itf->config.BatchSize; i++) {
+    data->rx.iov[i].iov_base = data->buffer+i*itf->config.BufferSize;
+    data->rx.iov[i].iov_len = itf->config.BufferSize;
+  }
+  pthread_mutex_init(&(data->txlock), NULL);
+#else
+  data->buffer = (unsigned char *) malloc(itf->config.BufferSize);
+#endif
   itf->data = (void *) data;
 
   /* lookup hostname/ip address */
@@ -105,9 +217,14 @@ struct mbn_interface * MBN_EXPORT mbnUDPOpen(char *remotehost, char *remoteport,
     if (remoteserver == NULL) {
       sprintf(err, "gethostbyname error: %s", strerror(errno));
       error++;
-    }
-    data->defaultaddr = *((unsigned long *)remoteserver->h_addr_list[0]);
+    } else
+      data->defaultaddr = ((struct in_addr *)remoteserver->h_addr_list[0])->s_addr;
   }
+  /* a multicast group as remote host, broadcasts are sent to the group
+   * once, and we listen to it on the same port unless told otherwise */
+  data->multicast = data->defaultaddr != 0 && IN_MULTICAST(ntohl(data->defaultaddr));
+  if(data->multicast && localport == NULL)
+    localport = remoteport != NULL ? remoteport : "";
 
   if(remoteport == NULL)
     remoteport = MBN_UDP_PORT;
@@ -139,16 +256,63 @@ struct mbn_interface * MBN_EXPORT mbnUDPOpen(char *remotehost, char *remoteport,
     si_me.sin_family = AF_INET;
     si_me.sin_port = htons(port);
     si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+    /* other sockets on this host may listen to the group on the same port */
+    if(data->multicast)
+      setsockopt(data->socket, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(reuse));
     if(bind(data->socket, (struct sockaddr *)&si_me, sizeof(si_me))==-1) {
       sprintf(err, "bind(): %s", strerror(errno));
       error++;
     }
   }
 
+  /* join the group */
+  if(!error && data->multicast) {
+    mreq.imr_multiaddr.s_addr = data->defaultaddr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if(setsockopt(data->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void *)&mreq, sizeof(mreq)) < 0) {
+      sprintf(err, "Can't join multicast group: %s", strerror(errno));
+      error++;
+    }
+  }
+
+  /* multicast loopback stays on for the other sockets on this host that
+   * listen to the group, so find out where our datagrams come from */
+  if(!error && data->multicast) {
+    addrlength = sizeof(si_me);
+    if(getsockname(data->socket, (struct sockaddr *)&si_me, &addrlength) == 0)
+      data->selfport = si_me.sin_port;
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = data->defaultport;
+    si_me.sin_addr.s_addr = data->defaultaddr;
+    addrlength = sizeof(si_me);
+    if((s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0
+        || connect(s, (struct sockaddr *)&si_me, sizeof(si_me)) < 0
+        || getsockname(s, (struct sockaddr *)&si_me, &addrlength) < 0) {
+      sprintf(err, "Can't find our address in the multicast group: %s", strerror(errno));
+      error++;
+    } else
+      data->selfaddr = si_me.sin_addr.s_addr;
+    if(s >= 0)
+      close(s);
+  }
+
   /* something went wrong in the above statements */
   if(error) {
     close(data->socket);
     free(itf);
+    free(data->addr);
+    free(data->active);
+    free(data->bucket);
+    pthread_mutex_destroy(&(data->peerlock));
+    free(data->buffer);
+    fwd_dedup_free(&(data->dedup));
+#ifdef MBNP_linux
+    udp_batch_free(&(data->rx));
+    udp_batch_free(&(data->fw));
+    udp_batch_free(&(data->tx));
+    pthread_mutex_destroy(&(data->txlock));
+#endif
     free(data);
 #ifdef MBNP_mingw
     WSACleanup();
@@ -161,6 +325,7 @@ struct mbn_interface * MBN_EXPORT mbnUDPOpen(char *remotehost, char *remoteport,
   itf->cb_free = udp_free;
   itf->cb_free_addr = udp_free_addr;
   itf->cb_transmit = udp_transmit;
+  itf->cb_transmit_batch = udp_transmit_batch;
 
   return itf;
 }
@@ -205,6 +370,18 @@ void udp_free(struct mbn_interface *itf) {
 
   pthread_cancel(dat->thread);
   pthread_join(dat->thread, NULL);
+  free(dat->addr);
+  free(dat->active);
+  free(dat->bucket);
+  pthread_mutex_destroy(&(dat->peerlock));
+  free(dat->buffer);
+  fwd_dedup_free(&(dat->dedup));
+#ifdef MBNP_linux
+  udp_batch_free(&(dat->rx));
+  udp_batch_free(&(dat->fw));
+  udp_batch_free(&(dat->tx));
+  pthread_mutex_destroy(&(dat->txlock));
+#endif
   free(dat);
   free(itf);
 #ifdef MBNP_mingw
@@ -213,31 +390,207 @@ void udp_free(struct mbn_interface *itf) {
 }
 
 
+/* Called when the library doesn't use a peer anymore */
 void udp_free_addr(struct mbn_interface *itf, void *arg) {
+  struct udpdat *dat = (struct udpdat *)itf->data;
   struct udpaddr *addr = arg;
+
+  pthread_mutex_lock(&(dat->peerlock));
+  if(addr->addr != 0)
+    udp_remove_peer(itf, dat, addr-dat->addr);
+  pthread_mutex_unlock(&(dat->peerlock));
+}
+
+
+/* Takes a peer out of the table, dat->peerlock should be locked */
+void udp_remove_peer(struct mbn_interface *itf, struct udpdat *dat, int i) {
+  struct udpaddr *addr = &(dat->addr[i]);
   struct in_addr in;
+  int *p;
 
   in.s_addr = addr->addr;
   mbnWriteLogMessage(itf, "Remove UDP connection to/from %s:%d", inet_ntoa(in), ntohs(addr->port));
 
+  /* unlink from its bucket */
+  for(p=&(dat->bucket[UDP_HASH(dat, addr->addr, addr->port)]); *p != i; p=&(dat->addr[*p].next))
+    ;
+  *p = addr->next;
+  /* move the last active peer into its place */
+  dat->active[addr->active] = dat->active[--dat->count];
+  dat->addr[dat->active[addr->active]].active = addr->active;
+
   addr->addr = 0;
   addr->port = 0;
+  addr->used = 0;
+  addr->next = dat->free;
+  dat->free = i;
+}
+
+
+/* Forgets the peers that haven't sent anything for ForwardTimeout seconds.
+ * The ones the library may still have in its address table are kept,
+ * whatever their timeouts, those are removed by udp_free_addr().
+ * dat->peerlock should be locked */
+void udp_age_peers(struct mbn_interface *itf, struct udpdat *dat, unsigned long now) {
+  int k;
+
+  dat->aged = now;
+  for(k=dat->count-1; k>=0; k--)
+    if(!dat->addr[dat->active[k]].used && now-dat->addr[dat->active[k]].seen >= (unsigned long)itf->config.ForwardTimeout*1000)
+      udp_remove_peer(itf, dat, dat->active[k]);
+}
+
+
+/* Returns the address entry of the peer a datagram came from, a new peer
+ * is added to the table, and marks it used by the library. Returns NULL
+ * when the table is full. */
+void *udp_peer(struct mbn_interface *itf, struct udpdat *dat, struct sockaddr_in *from) {
+  struct udpaddr *addr;
+  unsigned long now = monotonic_ms();
+  int i, h = UDP_HASH(dat, from->sin_addr.s_addr, from->sin_port);
+
+  pthread_mutex_lock(&(dat->peerlock));
+  for(i=dat->bucket[h]; i >= 0; i=dat->addr[i].next)
+    if(dat->addr[i].addr == from->sin_addr.s_addr && dat->addr[i].port == from->sin_port)
+      break;
+  if(i < 0) {
+    /* make room by forgetting the idle peers */
+    if(dat->free < 0)
+      udp_age_peers(itf, dat, now);
+    if((i = dat->free) < 0) {
+      pthread_mutex_unlock(&(dat->peerlock));
+      return NULL;
+    }
+    addr = &(dat->addr[i]);
+    dat->free = addr->next;
+    addr->addr = from->sin_addr.s_addr;
+    addr->port = from->sin_port;
+    addr->next = dat->bucket[h];
+    dat->bucket[h] = i;
+    addr->active = dat->count;
+    dat->active[dat->count++] = i;
+    mbnWriteLogMessage(itf, "Add UDP connection to/from %s:%d", inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+  }
+  dat->addr[i].seen = now;
+  dat->addr[i].used = 1;
+  pthread_mutex_unlock(&(dat->peerlock));
+  return &(dat->addr[i]);
+}
+
+
+/* Sends a received broadcast on to all other peers, on Linux it is
+ * added to the batch that is sent after the received batch is handled */
+void udp_forward(struct mbn_interface *itf, struct udpdat *dat, void *ifaddr, unsigned char *buf, int length) {
+  char err[MBN_ERRSIZE];
+  struct udpaddr *addr;
+  int k;
+
+  pthread_mutex_lock(&(dat->peerlock));
+  for(k=0; k<dat->count; k++) {
+    addr = &(dat->addr[dat->active[k]]);
+    if(addr == ifaddr)
+      continue;
+#ifdef MBNP_linux
+    udp_batch_add(dat, &(dat->fw), buf, length, addr->addr, addr->port, err);
+#else
+    udp_transmit(itf, buf, length, (void *)addr, err);
+#endif
+  }
+  pthread_mutex_unlock(&(dat->peerlock));
+  itf = NULL;
+}
+
+
+/* FNV-1a hash of a datagram, which can be continued over its frames */
+unsigned long udp_hash(unsigned long h, unsigned char *buf, int length) {
+  int i;
+
+  for(i=0; i<length; i++)
+    h = ((h ^ buf[i]) * 16777619UL) & 0xFFFFFFFFUL;
+  return h;
+}
+
+
+/* Remembers the hash of a datagram we're about to send to the group */
+void udp_sent_group(struct udpdat *dat, unsigned long hash) {
+  pthread_mutex_lock(&(dat->peerlock));
+  dat->selfsent[dat->selfnext] = hash;
+  dat->selfnext = (dat->selfnext+1) % SELFSENT;
+  pthread_mutex_unlock(&(dat->peerlock));
+}
+
+
+/* Returns 1 if a datagram is one we sent to the group ourselves */
+int udp_own_datagram(struct udpdat *dat, unsigned char *buf, int length, struct sockaddr_in *from) {
+  unsigned long hash;
+  int i;
+
+  if(from->sin_addr.s_addr != dat->selfaddr || from->sin_port != dat->selfport)
+    return 0;
+
+  hash = udp_hash(2166136261UL, buf, length);
+  pthread_mutex_lock(&(dat->peerlock));
+  for(i=0; i<SELFSENT; i++)
+    if(dat->selfsent[i] == hash)
+      break;
+  /* each copy comes back only once */
+  if(i < SELFSENT)
+    dat->selfsent[i] = 0;
+  pthread_mutex_unlock(&(dat->peerlock));
+  return i < SELFSENT;
 }
 
 
-/* Waits for input from network */
+/* Handles the frames in a datagram right where they are */
+void udp_receive_datagram(struct mbn_interface *itf, struct udpdat *dat, unsigned char *buf, int length, struct sockaddr_in *from) {
+  void *ifaddr = NULL;
+  int i, start = -1;
+
+  /* our own datagram, looped back by the multicast group */
+  if(dat->multicast && udp_own_datagram(dat, buf, length, from))
+    return;
+
+  for(i=0; i<length; i++) {
+    /* ignore non-start bytes if we haven't started yet */
+    if(start < 0) {
+      if(buf[i] >= 0x80 && buf[i] < 0xFF)
+        start = i;
+      continue;
+    }
+    /* we have a full message, send it to mambanet stack for processing */
+    if(buf[i] == 0xFF) {
+      if(i-start+1 >= MBN_MIN_MESSAGE_SIZE && ifaddr == NULL)
+        ifaddr = udp_peer(itf, dat, from);
+      if(i-start+1 >= MBN_MIN_MESSAGE_SIZE
+          && !(buf[start] == 0x81 && fwd_duplicate(itf, &(dat->dedup), buf+start, i-start+1, ifaddr))) {
+        /* with multicast the other peers got it from the group */
+        if(buf[start] == 0x81 && !dat->multicast)
+          udp_forward(itf, dat, ifaddr, buf+start, i-start+1);
+        mbnProcessRawMessage(itf, buf+start, i-start+1, ifaddr);
+      }
+      start = -1;
+    /* message was way too long, ignore it */
+    } else if(i-start+1 >= MBN_MAX_MESSAGE_SIZE)
+      start = -1;
+  }
+}
+
+
+/* Waits for input from network, on Linux everything that has arrived
+ * is taken with recvmmsg(), BatchSize datagrams at a time */
 void *udp_receive_packets(void *ptr) {
   struct mbn_interface *itf = (struct mbn_interface *)ptr;
   struct udpdat *dat = (struct udpdat *) itf->data;
-  unsigned char buffer[BUFFERSIZE], msgbuf[MBN_MAX_MESSAGE_SIZE];
   char err[MBN_ERRSIZE];
-  int i, j, msgbuflen = 0;
   fd_set rdfd;
   struct timeval tv;
-  struct sockaddr_in from;
   ssize_t rd;
-  void *ifaddr, *ipaddr;
+#ifdef MBNP_linux
+  int i;
+#else
+  struct sockaddr_in from;
   socklen_t addrlength = sizeof(struct sockaddr_in);
+#endif
 
   dat->thread_run = 1;
 
@@ -245,6 +598,12 @@ void *udp_receive_packets(void *ptr) {
     /* we can safely cancel here */
     pthread_testcancel();
 
+    /* forget the peers we haven't heard from for a while */
+    if(monotonic_ms()-dat->aged >= 1000) {
+      pthread_mutex_lock(&(dat->peerlock));
+      udp_age_peers(itf, dat, monotonic_ms());
+      pthread_mutex_unlock(&(dat->peerlock));
+    }
 
     /* check for incoming data */
     FD_ZERO(&rdfd);
@@ -256,13 +615,30 @@ void *udp_receive_packets(void *ptr) {
       continue;
     if(rd < 0) {
       sprintf(err, "Couldn't check for new packets: %s", strerror(errno));
-      printf("error\n");
       mbnInterfaceReadError(itf, err);
       break;
     }
 
     /* read incoming data */
-    rd = recvfrom(dat->socket, buffer, BUFFERSIZE, 0, (struct sockaddr *)&from, &addrlength);
+#ifdef MBNP_linux
+    do {
+      for(i=0; i<dat->rx.size; i++)
+        dat->rx.msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      if((rd = recvmmsg(dat->socket, dat->rx.msg, dat->rx.size, MSG_DONTWAIT, NULL)) <= 0)
+        break;
+      for(i=0; i<rd; i++)
+        udp_receive_datagram(itf, dat, (unsigned char *)dat->rx.iov[i].iov_base, dat->rx.msg[i].msg_len, &(dat->rx.addr[i]));
+      /* and send the broadcasts on to the other peers */
+      if(dat->fw.count > 0)
+        udp_flush_batch(dat, &(dat->fw), err);
+    } while(rd == dat->rx.size);
+    if(rd < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      sprintf(err, "Couldn't receive packet: %s", strerror(errno));
+      mbnInterfaceReadError(itf, err);
+      break;
+    }
+#else
+    rd = recvfrom(dat->socket, dat->buffer, itf->config.BufferSize, 0, (struct sockaddr *)&from, &addrlength);
     if(rd == 0 || (rd < 0 && errno == EINTR))
       continue;
     if(rd < 0) {
@@ -270,47 +646,8 @@ void *udp_receive_packets(void *ptr) {
       mbnInterfaceReadError(itf, err);
       break;
     }
-
-    /* handle the data */
-    for(i=0; i<rd; i++) {
-      /* ignore non-start bytes if we haven't started yet */
-      if(msgbuflen == 0 && !(buffer[i] >= 0x80 && buffer[i] < 0xFF))
-        continue;
-      msgbuf[msgbuflen++] = buffer[i];
-      /* we have a full message, send buffer to mambanet stack for processing */
-      if(buffer[i] == 0xFF) {
-        if(msgbuflen >= MBN_MIN_MESSAGE_SIZE) {
-          /* get HW address pointer from mbn */
-          ipaddr = ifaddr = NULL;
-          for(j=0; j<ADDLSTSIZE-1; j++) {
-            if((ipaddr == NULL) && (dat->addr[j].addr == 0))
-              ipaddr = &dat->addr[j];
-            if ((dat->addr[j].addr == from.sin_addr.s_addr) && (dat->addr[j].port == from.sin_port)) {
-              ifaddr = &dat->addr[j];
-              break;
-            }
-          }
-          if(ifaddr == NULL) {
-            ifaddr = ipaddr;
-            ((struct udpaddr *)ifaddr)->addr = from.sin_addr.s_addr;
-            ((struct udpaddr *)ifaddr)->port = from.sin_port;
-            mbnWriteLogMessage(itf, "Add UDP connection to/from %s:%d", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
-          }
-          if(buffer[0] == 0x81) {
-            for(j=0; j<ADDLSTSIZE; j++) {
-              if(dat->socket >= 0 && &(dat->addr[j]) != ifaddr) {
-                udp_transmit(itf, msgbuf, msgbuflen, (void *)&(dat->addr[j]), err);
-              }
-            }
-          }
-          mbnProcessRawMessage(itf, msgbuf, msgbuflen, ifaddr);
-        }
-        msgbuflen = 0;
-      }
-      /* message was way too long, ignore it */
-      if(msgbuflen >= MBN_MAX_MESSAGE_SIZE)
-        msgbuflen = 0;
-    }
+    udp_receive_datagram(itf, dat, dat->buffer, rd, &from);
+#endif
   }
 
   return NULL;
@@ -324,31 +661,46 @@ int udp_transmit(struct mbn_interface *itf, unsigned char *buffer, int length, v
   int rd, sent, i;
   char def_remote_done = 0;
 
+#ifdef MBNP_linux
+  /* a broadcast goes to all peers with one system call */
+  if(dest_udpaddr == NULL) {
+    struct mbn_txframe frame;
+
+    frame.buffer = buffer;
+    frame.length = length;
+    frame.ifaddr = NULL;
+    return udp_transmit_batch(itf, &frame, 1, err);
+  }
+#endif
+
   memset((void *)&daddr, 0, sizeof(struct sockaddr_in));
   daddr.sin_family   = AF_INET;
 
   if (dest_udpaddr == NULL) {
-    for(i=0; i<ADDLSTSIZE; i++) {
-      if (dat->addr[i].addr == 0)
-        continue;
-
-      daddr.sin_port = dat->addr[i].port;
-      daddr.sin_addr.s_addr = dat->addr[i].addr;
+    /* our own broadcasts are dropped when they come back */
+    if(buffer[0] == 0x81)
+      fwd_remember(&(dat->dedup), buffer, length);
+    pthread_mutex_lock(&(dat->peerlock));
+    for(i=0; i<dat->count && !dat->multicast; i++) {
+      daddr.sin_port = dat->addr[dat->active[i]].port;
+      daddr.sin_addr.s_addr = dat->addr[dat->active[i]].addr;
 
       /* send data */
       sent = 0;
       while((rd = sendto(dat->socket, &(buffer[sent]), length-sent, 0, (struct sockaddr *)&daddr, sizeof(struct sockaddr_in))) < length-sent) {
         if(rd < 0) {
           sprintf(err, "Can't send packet: %s", strerror(errno));
+          pthread_mutex_unlock(&(dat->peerlock));
           return 1;
         }
         sent += rd;
       }
 
-      if ((daddr.sin_port == dat->defaultport) && (daddr.sin_addr.s_addr = dat->defaultaddr)) {
+      if ((daddr.sin_port == dat->defaultport) && (daddr.sin_addr.s_addr == dat->defaultaddr)) {
         def_remote_done = 1;
       }
     }
+    pthread_mutex_unlock(&(dat->peerlock));
     /* broadcast done, clear transmit address */
     daddr.sin_port = 0;
     daddr.sin_addr.s_addr = 0;
@@ -364,6 +716,8 @@ int udp_transmit(struct mbn_interface *itf, unsigned char *buffer, int length, v
 
   if (daddr.sin_addr.s_addr != 0)
   {
+    if(dat->multicast && daddr.sin_addr.s_addr == dat->defaultaddr)
+      udp_sent_group(dat, udp_hash(2166136261UL, buffer, length));
     sent = 0;
     while((rd = sendto(dat->socket, &(buffer[sent]), length-sent, 0, (struct sockaddr *)&daddr, sizeof(struct sockaddr_in))) < length-sent) {
       if(rd < 0) {
@@ -377,3 +731,148 @@ int udp_transmit(struct mbn_interface *itf, unsigned char *buffer, int length, v
   return 0;
 }
 
+
+#ifdef MBNP_linux
+/* Allocates a batch of size datagrams, each with its own address */
+void udp_batch_init(struct udpbatch *b, int size) {
+  int i;
+
+  b->msg = (struct mmsghdr *) calloc(size, sizeof(struct mmsghdr));
+  b->iov = (struct iovec *) calloc(size, sizeof(struct iovec));
+  b->addr = (struct sockaddr_in *) calloc(size, sizeof(struct sockaddr_in));
+  b->size = size;
+  b->count = 0;
+  for(i=0; i<size; i++) {
+    b->msg[i].msg_hdr.msg_name = &(b->addr[i]);
+    b->msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    b->msg[i].msg_hdr.msg_iov = &(b->iov[i]);
+    b->msg[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+
+void udp_batch_free(struct udpbatch *b) {
+  free(b->msg);
+  free(b->iov);
+  free(b->addr);
+}
+
+
+/* hands all collected datagrams to the kernel */
+int udp_flush_batch(struct udpdat *dat, struct udpbatch *b, char *err) {
+  int i = 0, rd;
+
+  while(i < b->count) {
+    if((rd = sendmmsg(dat->socket, &(b->msg[i]), b->count-i, 0)) < 0) {
+      if(errno == EINTR)
+        continue;
+      sprintf(err, "Can't send packet: %s", strerror(errno));
+      b->count = 0;
+      return 1;
+    }
+    i += rd;
+  }
+  b->count = 0;
+  return 0;
+}
+
+
+/* adds one datagram to the batch, flushes when the batch is full */
+int udp_batch_add(struct udpdat *dat, struct udpbatch *b, unsigned char *buffer, int length, unsigned long addr, unsigned short port, char *err) {
+  b->iov[b->count].iov_base = buffer;
+  b->iov[b->count].iov_len = length;
+  return udp_batch_addv(dat, b, &(b->iov[b->count]), 1, addr, port, err);
+}
+
+
+/* adds a datagram made up of iovlen buffers, iov must stay valid until
+ * the batch has been flushed */
+int udp_batch_addv(struct udpdat *dat, struct udpbatch *b, struct iovec *iov, int iovlen, unsigned long addr, unsigned short port, char *err) {
+  int n = b->count;
+
+  b->addr[n].sin_family = AF_INET;
+  b->addr[n].sin_port = port;
+  b->addr[n].sin_addr.s_addr = addr;
+  b->msg[n].msg_hdr.msg_iov = iov;
+  b->msg[n].msg_hdr.msg_iovlen = iovlen;
+
+  if(++b->count == b->size)
+    return udp_flush_batch(dat, b, err);
+  return 0;
+}
+#endif
+
+
+/* Sends a batch of frames with as few system calls as possible, to the
+ * same destinations as udp_transmit() would use. With a PacketSize, the
+ * frames for the same destination are packed into one datagram. */
+int udp_transmit_batch(struct mbn_interface *itf, struct mbn_txframe *frames, int count, char *err) {
+#ifdef MBNP_linux
+  struct udpdat *dat = (struct udpdat *) itf->data;
+  struct udpbatch *b = &(dat->tx);
+  struct udpaddr *dest;
+  struct iovec *iov;
+  char packed[MBN_TX_BATCH];
+  int list[MBN_TX_BATCH];
+  int i, j, k, m, n, r = 0;
+  unsigned long h;
+  char def_remote_done;
+
+  pthread_mutex_lock(&(dat->txlock));
+  while(count > 0) {
+    n = count > MBN_TX_BATCH ? MBN_TX_BATCH : count;
+    memset((void *)packed, 0, n);
+    for(i=0, m=0; i<n; i++) {
+      if(packed[i])
+        continue;
+      /* the frames of a datagram each get their own iovec */
+      k = fwd_pack(frames, n, i, itf->config.PacketSize, packed, list);
+      iov = &(dat->pack[m]);
+      for(j=0; j<k; j++) {
+        iov[j].iov_base = frames[list[j]].buffer;
+        iov[j].iov_len = frames[list[j]].length;
+      }
+      m += k;
+      dest = (struct udpaddr *) frames[i].ifaddr;
+      if(dest != NULL) {
+        if(dest->addr != 0)
+          r |= udp_batch_addv(dat, b, iov, k, dest->addr, dest->port, err);
+        continue;
+      }
+      /* our own broadcasts are dropped when they come back */
+      for(j=0; j<k; j++)
+        if(frames[list[j]].buffer[0] == 0x81)
+          fwd_remember(&(dat->dedup), frames[list[j]].buffer, frames[list[j]].length);
+      def_remote_done = 0;
+      pthread_mutex_lock(&(dat->peerlock));
+      for(j=0; j<dat->count && !dat->multicast; j++) {
+        dest = &(dat->addr[dat->active[j]]);
+        r |= udp_batch_addv(dat, b, iov, k, dest->addr, dest->port, err);
+        if(dest->port == dat->defaultport && dest->addr == dat->defaultaddr)
+          def_remote_done = 1;
+      }
+      pthread_mutex_unlock(&(dat->peerlock));
+      if(!def_remote_done && dat->defaultaddr != 0 && dat->multicast) {
+        for(j=0, h=2166136261UL; j<k; j++)
+          h = udp_hash(h, frames[list[j]].buffer, frames[list[j]].length);
+        udp_sent_group(dat, h);
+      }
+      if(!def_remote_done && dat->defaultaddr != 0)
+        r |= udp_batch_addv(dat, b, iov, k, dat->defaultaddr, dat->defaultport, err);
+    }
+    if(b->count > 0)
+      r |= udp_flush_batch(dat, b, err);
+    frames += n;
+    count -= n;
+  }
+  pthread_mutex_unlock(&(dat->txlock));
+  return r;
+#else
+  int i, r = 0;
+
+  for(i=0; i<count; i++)
+    r |= udp_transmit(itf, frames[i].buffer, frames[i].length, frames[i].ifaddr, err);
+  return r;
+#endif
+}
+
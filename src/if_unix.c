@@ -17,6 +17,7 @@
 
 #define _XOPEN_SOURCE 600
 #define _XOPEN_SOURCE_EXTENDED 1
+#define _GNU_SOURCE /* SO_PASSCRED */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,32 +33,57 @@
 #include <sys/time.h>
 #include <netdb.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <pthread.h>
 
 #include "mbn.h"
+#include "sendq.h"
+#include "fwdtable.h"
 
 #define MAX(a, b) ((a)>(b)?(a):(b))
-/* the actual number of max. connections is also limited by the
+/* defaults for the interface configuration,
+ * the actual number of max. connections is also limited by the
  * number of sockets the select() call accepts.
- * Each connection requires about 128 bytes for buffers */
+ * Each connection has a receive buffer of BufferSize bytes */
 #define MAX_CONNECTIONS 10
-#define BUFFERSIZE     512
+#define BUFFERSIZE    8192
+/* the send queue of a connection is only allocated when the connection can't keep up */
+#define SENDQUEUESIZE  16384
+#define SENDQUEUEHIGH  12288
+#define SENDQUEUELOW    4096
+/* forwarding table: number of addresses, and the seconds after which
+ * a node that hasn't sent anything is forgotten */
+#define ADDLSTSIZE     1000
+#define FORWARDTIMEOUT  300
+/* milliseconds a broadcast is remembered, to drop its copies */
+#define DUPLICATEWINDOW 100
 
 
 struct unixconn {
-  unsigned char buf[MBN_MAX_MESSAGE_SIZE];
-  int buflen;
+  unsigned char *buf; /* receive buffer, frames are processed right from here */
+  int buflen; /* bytes of an incomplete frame at the start of buf */
   int socket; /* -1 when unused */
   char remote_path[108];
+  struct sendq sendq;
+  char writing; /* waiting for the socket to become writable */
+  char closing; /* shut down by the transmit side, receiver will close it */
 };
 
 struct unixdat {
   pthread_t thread;
   char thread_run;
   char listen_path[108];
-  struct unixconn conn[MAX_CONNECTIONS];
+  struct unixconn *conn;
+  pthread_mutex_t lock; /* for sending */
   int client_socket;
   int listen_socket;
+  /* written to when a send queue gets data, to wake up the receiver */
+  int wakeup[2];
+  /* connection the nodes were seen on, to switch unicast messages between
+   * connections, our own nodes are learned as a pointer to this struct */
+  struct fwd_table fwd;
+  struct fwd_dedup dedup;
 };
 
 int setup_unix_client(struct unixdat *, char *, char *);
@@ -67,23 +93,62 @@ void stop_unix(struct mbn_interface *);
 void free_unix(struct mbn_interface *);
 void free_addr_unix(struct mbn_interface *, void *);
 void *unix_receiver(void *);
+void transmit_unix_connection(struct mbn_interface *, struct unixconn *, unsigned char *, int);
 int unix_transmit(struct mbn_interface *, unsigned char *, int, void *, char *);
+int unix_transmit_batch(struct mbn_interface *, struct mbn_txframe *, int, char *);
+int queue_status_unix(struct mbn_interface *, void *, struct mbn_queue_status *);
 
 
 struct mbn_interface * MBN_EXPORT mbnUnixOpen(char *remote_path, char *my_path, char *err) {
+  return mbnUnixOpenConfig(remote_path, my_path, NULL, err);
+}
+
+
+struct mbn_interface * MBN_EXPORT mbnUnixOpenConfig(char *remote_path, char *my_path, struct mbn_if_config *config, char *err) {
   struct mbn_interface *itf;
   struct unixdat *dat;
   int i, error = 0;
 
   itf = (struct mbn_interface *)calloc(1, sizeof(struct mbn_interface));
+  itf->config.BufferSize = BUFFERSIZE;
+  itf->config.MaxConnections = MAX_CONNECTIONS;
+  itf->config.SendQueueSize = SENDQUEUESIZE;
+  itf->config.SendQueueHigh = SENDQUEUEHIGH;
+  itf->config.SendQueueLow = SENDQUEUELOW;
+  itf->config.SlowConsumer = MBN_SLOWCONSUMER_DROP;
+  itf->config.AddressListSize = ADDLSTSIZE;
+  itf->config.ForwardTimeout = FORWARDTIMEOUT;
+  itf->config.DuplicateWindow = DUPLICATEWINDOW;
+  if(mbnInterfaceConfig(itf, config, err) != 0) {
+    free(itf);
+    return NULL;
+  }
   dat = (struct unixdat *)calloc(1, sizeof(struct unixdat));
   itf->data = (void *)dat;
 
   /* initialize connection table */
-  for(i=0; i<MAX_CONNECTIONS; i++)
+  dat->conn = (struct unixconn *)calloc(itf->config.MaxConnections, sizeof(struct unixconn));
+  for(i=0; i<itf->config.MaxConnections; i++) {
+    dat->conn[i].buf = (unsigned char *)malloc(itf->config.BufferSize);
     dat->conn[i].socket = -1;
+    sendq_init(&(dat->conn[i].sendq), &(itf->config));
+  }
+  pthread_mutex_init(&(dat->lock), NULL);
+  fwd_init(&(dat->fwd), itf->config.AddressListSize, itf->config.ForwardTimeout);
+  fwd_dedup_init(&(dat->dedup), itf->config.DuplicateWindow);
 
-  if(remote_path != NULL) {
+  if(pipe(dat->wakeup) < 0) {
+    sprintf(err, "pipe(): %s", strerror(errno));
+    dat->wakeup[0] = dat->wakeup[1] = -1;
+    error++;
+  } else {
+    fcntl(dat->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(dat->wakeup[1], F_SETFL, O_NONBLOCK);
+  }
+
+  if(error)
+    dat->client_socket = -1;
+  else if(remote_path != NULL) {
     error += setup_unix_client(dat, remote_path, err);
   }
   else
@@ -95,6 +160,16 @@ struct mbn_interface * MBN_EXPORT mbnUnixOpen(char *remote_path, char *my_path,
     dat->listen_socket = -1;
 
   if(error) {
+    if(dat->wakeup[0] >= 0) {
+      close(dat->wakeup[0]);
+      close(dat->wakeup[1]);
+    }
+    fwd_free(&(dat->fwd));
+    fwd_dedup_free(&(dat->dedup));
+    pthread_mutex_destroy(&(dat->lock));
+    for(i=0; i<itf->config.MaxConnections; i++)
+      free(dat->conn[i].buf);
+    free(dat->conn);
     free(dat);
     free(itf);
     return NULL;
@@ -105,6 +180,8 @@ struct mbn_interface * MBN_EXPORT mbnUnixOpen(char *remote_path, char *my_path,
   itf->cb_free = free_unix;
   itf->cb_free_addr = free_addr_unix;
   itf->cb_transmit = unix_transmit;
+  itf->cb_transmit_batch = unix_transmit_batch;
+  itf->cb_queue_status = queue_status_unix;
   return itf;
 }
 
@@ -221,13 +298,22 @@ void free_unix(struct mbn_interface *itf) {
   pthread_cancel(dat->thread);
   pthread_join(dat->thread, NULL);
 
-  for(i=0; i<MAX_CONNECTIONS; i++)
+  for(i=0; i<itf->config.MaxConnections; i++) {
     if(dat->conn[i].socket >= 0)
       close(dat->conn[i].socket);
+    sendq_clear(&(dat->conn[i].sendq));
+    free(dat->conn[i].buf);
+  }
 
   if (dat->listen_socket >= 0)
     close(dat->listen_socket);
+  close(dat->wakeup[0]);
+  close(dat->wakeup[1]);
 
+  fwd_free(&(dat->fwd));
+  fwd_dedup_free(&(dat->dedup));
+  pthread_mutex_destroy(&(dat->lock));
+  free(dat->conn);
   free(dat);
   free(itf);
 }
@@ -244,12 +330,12 @@ void new_unix_connection(struct mbn_interface *itf, struct unixdat *dat) {
   struct sockaddr_un remote_addr;
   unsigned int remote_addr_length = sizeof(remote_addr);
 
-  for(i=0; i<MAX_CONNECTIONS; i++)
+  for(i=0; i<itf->config.MaxConnections; i++)
     if(dat->conn[i].socket < 0)
       break;
 
-  /* MAX_CONNECTIONS reached, just close the connection */
-  if(i >= MAX_CONNECTIONS) {
+  /* MaxConnections reached, just close the connection */
+  if(i >= itf->config.MaxConnections) {
     if((i = accept(dat->listen_socket, (struct sockaddr *)&remote_addr, &remote_addr_length)) > 0)
       close(i);
     mbnWriteLogMessage(itf, "Rejected unix connection from %s", remote_addr.sun_path);
@@ -260,59 +346,239 @@ void new_unix_connection(struct mbn_interface *itf, struct unixdat *dat) {
   if((dat->conn[i].socket = accept(dat->listen_socket, (struct sockaddr *)&remote_addr, &remote_addr_length)) < 0)
     return;
   dat->conn[i].buflen = 0;
+  dat->conn[i].writing = dat->conn[i].closing = 0;
   strncpy(dat->conn[i].remote_path, remote_addr.sun_path, 108);
 
   mbnWriteLogMessage(itf, "Accepted unix connection as socket %d", dat->conn[i].socket);
 }
 
+/* Forwards a message received on one connection to all others,
+ * or if to isn't NULL only to that connection */
+void forward_unix(struct mbn_interface *itf, struct unixdat *dat, struct unixconn *cn, struct unixconn *to, unsigned char *buf, int length) {
+  int i;
+
+  pthread_mutex_lock(&(dat->lock));
+  for(i=0; i<itf->config.MaxConnections; i++)
+    if(dat->conn[i].socket >= 0 && &(dat->conn[i]) != cn && (to == NULL || &(dat->conn[i]) == to))
+      transmit_unix_connection(itf, &(dat->conn[i]), buf, length);
+  pthread_mutex_unlock(&(dat->lock));
+}
+
+
+/* Processes the complete frames in the receive buffer of a connection
+ * right where they are, and moves the start of an incomplete frame to
+ * the start of the buffer, so the next recv() appends to it */
+void frame_unix_connection(struct mbn_interface *itf, struct unixdat *dat, struct unixconn *cn, int length) {
+  unsigned char *buf = cn->buf;
+  struct unixconn *to;
+  int i, start = cn->buflen > 0 ? 0 : -1;
+
+  for(i=cn->buflen; i<length; i++) {
+    /* ignore non-start bytes if we haven't started yet */
+    if(start < 0) {
+      if(buf[i] >= 0x80 && buf[i] < 0xFF)
+        start = i;
+      continue;
+    }
+    if(buf[i] == 0xFF) {
+      /* broadcasts we've just seen (or sent) are dropped */
+      if(i-start+1 >= MBN_MIN_MESSAGE_SIZE
+          && !(buf[start] == 0x81 && fwd_duplicate(itf, &(dat->dedup), buf+start, i-start+1, (void *)cn))) {
+        /* learn where the sender is, forward broadcasts to the other
+         * connections, and unicasts to the connection their destination
+         * was seen on (or to all if it isn't known). Messages for our own
+         * nodes, or for a node on the connection they came from, stay here. */
+        fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(buf+start), (void *)cn);
+        to = NULL;
+        if(buf[start] != 0x81)
+          to = (struct unixconn *)fwd_lookup(&(dat->fwd), FWD_ADDRESS_TO(buf+start));
+        if(to != cn && (void *)to != (void *)dat)
+          forward_unix(itf, dat, cn, to, buf+start, i-start+1);
+        /* now send to mbn */
+        mbnProcessRawMessage(itf, buf+start, i-start+1, (void *)cn);
+      }
+      start = -1;
+    /* message was way too long, ignore it */
+    } else if(i-start+1 >= MBN_MAX_MESSAGE_SIZE)
+      start = -1;
+  }
+
+  cn->buflen = start < 0 ? 0 : length-start;
+  if(start > 0)
+    memmove((void *)buf, (void *)(buf+start), cn->buflen);
+}
+
+
 int read_unix_connection(struct mbn_interface *itf, struct unixconn *cn, char *err) {
   struct unixdat *dat = (struct unixdat *)itf->data;
-  unsigned char buf[BUFFERSIZE];
-  int n, i, j;
-
-  n = recv(cn->socket, (char *)buf, BUFFERSIZE, 0);
-  if(n < 0 && errno == EINTR)
-    return 0;
-
-  /* error, close connection */
-  if(n <= 0) {
-    close(cn->socket);
-    /* oops, this was our remote connection, we shouldn't lose this one! */
-    if(dat->client_socket == cn->socket) {
-      mbnWriteLogMessage(itf, "Lost connection to server");
-      sprintf(err, "Lost connection to server");
-      return 1;
+  int n;
+
+  /* keep reading until there's nothing left, saves a select() for every read */
+  while(1) {
+    n = recv(cn->socket, (char *)cn->buf+cn->buflen, itf->config.BufferSize-cn->buflen, MSG_DONTWAIT);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+
+    /* error, close connection */
+    if(n <= 0) {
+      fwd_forget(&(dat->fwd), (void *)cn);
+      pthread_mutex_lock(&(dat->lock));
+      close(cn->socket);
+      sendq_clear(&(cn->sendq));
+      /* oops, this was our remote connection, we shouldn't lose this one! */
+      if(dat->client_socket == cn->socket) {
+        pthread_mutex_unlock(&(dat->lock));
+        mbnWriteLogMessage(itf, "Lost connection to server");
+        sprintf(err, "Lost connection to server");
+        return 1;
+      }
+      cn->socket = -1;
+      pthread_mutex_unlock(&(dat->lock));
+      mbnWriteLogMessage(itf, "Closed connection for socket %d", cn->socket);
+      memset(cn->remote_path, 0, 108);
+      return 0;
+    }
+
+    /* handle the data */
+    frame_unix_connection(itf, dat, cn, cn->buflen+n);
+  }
+}
+
+
+/* Sends as much as possible without blocking,
+ * returns the number of bytes sent or -1 on error */
+int unix_send_nonblock(int sock, unsigned char *buf, int length) {
+  int n;
+
+  while((n = send(sock, (char *)buf, length, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    n = 0;
+  return n;
+}
+
+
+/* Shuts down a connection from the transmitting side, the receiver
+ * notices this and closes it. dat->lock should be locked */
+void disconnect_unix_connection(struct unixconn *cn) {
+  if(cn->closing)
+    return;
+  cn->closing = 1;
+  shutdown(cn->socket, SHUT_RDWR);
+  sendq_clear(&(cn->sendq));
+}
+
+
+/* Queues (the rest of) a frame that couldn't be sent right away, and
+ * wakes up the receiver to wait for the socket to become writable when
+ * the queue was empty. dat->lock should be locked */
+void queue_unix_frame(struct mbn_interface *itf, struct unixconn *cn, unsigned char *buf, int length, int done) {
+  struct unixdat *dat = (struct unixdat *)itf->data;
+  char congested = cn->sendq.congested;
+  int r;
+
+  r = sendq_push(&(cn->sendq), buf, length, done);
+  if(r == SENDQ_DISCONNECT) {
+    mbnWriteLogMessage(itf, "Disconnecting slow unix connection on socket %d (%d bytes queued)", cn->socket, cn->sendq.length);
+    disconnect_unix_connection(cn);
+    return;
+  }
+  if(!congested && cn->sendq.congested)
+    mbnWriteLogMessage(itf, "Unix connection on socket %d congested (%d bytes queued)", cn->socket, cn->sendq.length);
+  if(!cn->writing && cn->sendq.length > 0) {
+    cn->writing = 1;
+    r = write(dat->wakeup[1], "", 1);
+  }
+}
+
+
+/* Transmits a frame on a connection, or queues it when the socket
+ * isn't writable. dat->lock should be locked */
+void transmit_unix_connection(struct mbn_interface *itf, struct unixconn *cn, unsigned char *buf, int length) {
+  int n = 0;
+
+  if(cn->closing)
+    return;
+
+  /* nothing queued, try to send it right away */
+  if(cn->sendq.length == 0) {
+    if((n = unix_send_nonblock(cn->socket, buf, length)) < 0) {
+      disconnect_unix_connection(cn);
+      return;
+    }
+    if(n == length) {
+      cn->sendq.sent++;
+      return;
+    }
+  }
+  queue_unix_frame(itf, cn, buf, length, n);
+}
+
+
+/* Same as above for all frames of a batch that go to this connection,
+ * written with a single sendmsg() */
+void transmit_unix_connection_batch(struct mbn_interface *itf, struct unixconn *cn, struct mbn_txframe *frames, int count) {
+  struct iovec iov[MBN_TX_BATCH];
+  struct msghdr msg;
+  int i, n = 0, cnt = 0;
+
+  if(cn->closing)
+    return;
+
+  for(i=0; i<count && cnt<MBN_TX_BATCH; i++)
+    if(frames[i].ifaddr == NULL || frames[i].ifaddr == (void *)cn) {
+      iov[cnt].iov_base = (void *)frames[i].buffer;
+      iov[cnt++].iov_len = frames[i].length;
+    }
+  if(cnt == 0)
+    return;
+
+  /* nothing queued, try to send it right away */
+  if(cn->sendq.length == 0) {
+    memset((void *)&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    while((n = sendmsg(cn->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      disconnect_unix_connection(cn);
+      return;
     }
-    cn->socket = -1;
-    mbnWriteLogMessage(itf, "Closed connection for socket %d", cn->socket);
-    memset(cn->remote_path, 0, 108);
-    return 0;
+    if(n < 0)
+      n = 0;
   }
 
-  /* handle the data */
-  for(i=0; i<n; i++) {
-    if(cn->buflen == 0 && !(buf[i] >= 0x80 && buf[i] < 0xFF))
+  /* queue what's left */
+  for(i=0; i<cnt && !cn->closing; i++) {
+    if(n >= (int)iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      cn->sendq.sent++;
       continue;
-    cn->buf[cn->buflen++] = buf[i];
-    if(buf[i] == 0xFF) {
-      if(cn->buflen >= MBN_MIN_MESSAGE_SIZE) {
-        /* broadcast message, forward to the other connections */
-        /* TODO: this can block the thread, use a send buffer? */
-        if(buf[0] == 0x81) {
-          for(j=0; j<MAX_CONNECTIONS; j++)
-            if(dat->conn[j].socket >= 0 && &(dat->conn[j]) != cn) {
-              unix_transmit(itf, cn->buf, cn->buflen, (void *)&(dat->conn[j]), err);
-            }
-        }
-        /* now send to mbn */
-        mbnProcessRawMessage(itf, cn->buf, cn->buflen, (void *)cn);
-      }
-      cn->buflen = 0;
     }
-    if(cn->buflen >= MBN_MAX_MESSAGE_SIZE)
-      cn->buflen = 0;
+    queue_unix_frame(itf, cn, (unsigned char *)iov[i].iov_base, iov[i].iov_len, n);
+    n = 0;
   }
-  return 0;
+}
+
+
+/* Writes out the send queue of a connection, called when it's writable */
+void flush_unix_connection(struct unixdat *dat, struct unixconn *cn) {
+  unsigned char *buf;
+  int n, r;
+
+  pthread_mutex_lock(&(dat->lock));
+  while(!cn->closing && (n = sendq_peek(&(cn->sendq), &buf)) > 0) {
+    if((r = unix_send_nonblock(cn->socket, buf, n)) < 0)
+      disconnect_unix_connection(cn);
+    if(r <= 0)
+      break;
+    sendq_consume(&(cn->sendq), r);
+  }
+  if(cn->closing || cn->sendq.length == 0)
+    cn->writing = 0;
+  pthread_mutex_unlock(&(dat->lock));
 }
 
 
@@ -320,8 +586,9 @@ void *unix_receiver(void *ptr) {
   struct mbn_interface *itf = (struct mbn_interface *)ptr;
   struct unixdat *dat = (struct unixdat *)itf->data;
   char err[MBN_ERRSIZE];
+  unsigned char drain[64];
   struct timeval tv;
-  fd_set rdfd;
+  fd_set rdfd, wrfd;
   int n, i;
 
   dat->thread_run = 1;
@@ -331,21 +598,27 @@ void *unix_receiver(void *ptr) {
 
     /* select file descriptors */
     FD_ZERO(&rdfd);
-    n = 0;
+    FD_ZERO(&wrfd);
+    FD_SET(dat->wakeup[0], &rdfd);
+    n = dat->wakeup[0];
     if(dat->listen_socket >= 0) {
       FD_SET(dat->listen_socket, &rdfd);
       n = MAX(n, dat->listen_socket);
     }
-    for(i=0; i<MAX_CONNECTIONS; i++)
+    pthread_mutex_lock(&(dat->lock));
+    for(i=0; i<itf->config.MaxConnections; i++)
       if(dat->conn[i].socket >= 0) {
         FD_SET(dat->conn[i].socket, &rdfd);
+        if(dat->conn[i].writing)
+          FD_SET(dat->conn[i].socket, &wrfd);
         n = MAX(n, dat->conn[i].socket);
       }
+    pthread_mutex_unlock(&(dat->lock));
 
-    /* wait for readable sockets */
+    /* wait for readable sockets, or for writable ones with queued data */
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    n = select(n+1, &rdfd, NULL, NULL, &tv);
+    n = select(n+1, &rdfd, &wrfd, NULL, &tv);
     if(n == 0 || (n < 0 && errno == EINTR))
       continue;
     if(n < 0) {
@@ -354,15 +627,23 @@ void *unix_receiver(void *ptr) {
       break;
     }
 
+    /* the send queues are checked on every round anyway */
+    if(FD_ISSET(dat->wakeup[0], &rdfd))
+      while(read(dat->wakeup[0], drain, sizeof(drain)) > 0)
+        ;
+
     /* check for incoming connections */
     if(dat->listen_socket >= 0 && FD_ISSET(dat->listen_socket, &rdfd))
       new_unix_connection(itf, dat);
 
-    /* check for data on all connections */
-    for(i=0; i<MAX_CONNECTIONS; i++)
+    /* write queued data and check for data on all connections */
+    for(i=0; i<itf->config.MaxConnections; i++) {
+      if(dat->conn[i].socket >= 0 && FD_ISSET(dat->conn[i].socket, &wrfd))
+        flush_unix_connection(dat, &(dat->conn[i]));
       if(dat->conn[i].socket >=0 && FD_ISSET(dat->conn[i].socket, &rdfd))
         if(read_unix_connection(itf, &(dat->conn[i]), err))
           mbnInterfaceReadError(itf, err);
+    }
   }
   return NULL;
 }
@@ -373,14 +654,54 @@ int unix_transmit(struct mbn_interface *itf, unsigned char *buf, int length, voi
   struct unixdat *dat = (struct unixdat *)itf->data;
   int i;
 
-  for(i=0; i<MAX_CONNECTIONS; i++) {
+  /* messages from our own nodes aren't forwarded back to us */
+  fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(buf), (void *)dat);
+  if(buf[0] == 0x81)
+    fwd_remember(&(dat->dedup), buf, length);
+
+  pthread_mutex_lock(&(dat->lock));
+  for(i=0; i<itf->config.MaxConnections; i++) {
     if(dat->conn[i].socket < 0 || (cn != NULL && cn != &(dat->conn[i])))
       continue;
 
-    send(dat->conn[i].socket, (char *)buf, length, MSG_DONTWAIT);
+    transmit_unix_connection(itf, &(dat->conn[i]), buf, length);
   }
+  pthread_mutex_unlock(&(dat->lock));
   return 0;
   err = NULL;
 }
 
 
+int unix_transmit_batch(struct mbn_interface *itf, struct mbn_txframe *frames, int count, char *err) {
+  struct unixdat *dat = (struct unixdat *)itf->data;
+  int i;
+
+  for(i=0; i<count; i++) {
+    fwd_learn(&(dat->fwd), FWD_ADDRESS_FROM(frames[i].buffer), (void *)dat);
+    if(frames[i].buffer[0] == 0x81)
+      fwd_remember(&(dat->dedup), frames[i].buffer, frames[i].length);
+  }
+
+  pthread_mutex_lock(&(dat->lock));
+  for(i=0; i<itf->config.MaxConnections; i++)
+    if(dat->conn[i].socket >= 0)
+      transmit_unix_connection_batch(itf, &(dat->conn[i]), frames, count);
+  pthread_mutex_unlock(&(dat->lock));
+  return 0;
+  err = NULL;
+}
+
+
+int queue_status_unix(struct mbn_interface *itf, void *ifaddr, struct mbn_queue_status *status) {
+  struct unixconn *cn = (struct unixconn *)ifaddr;
+  struct unixdat *dat = (struct unixdat *)itf->data;
+  int r = 1;
+
+  pthread_mutex_lock(&(dat->lock));
+  if(cn != NULL && cn->socket >= 0) {
+    sendq_status(&(cn->sendq), status);
+    r = 0;
+  }
+  pthread_mutex_unlock(&(dat->lock));
+  return r;
+}
@@ -56,11 +56,51 @@ int mbnhandlers = 0;
 
 char versionString[256];
 
+/* checks the queue of messages requiring an acknowledge reply of a
+ * node, and retries the messages that haven't been acknowledged yet */
+void process_msgqueue(struct mbn_handler *mbn) {
+  struct mbn_msgqueue *q, *last, *tmp;
+
+  /* the msgqueue thread is the only thread that can free() items from the
+   * msgqueue list, so we don't have to lock while reading from it */
+  PLCK();
+  for(q=last=mbn->queue; q!=NULL; ) {
+    /* Remove item from the list */
+    if(q->retries == -1 || q->retries++ >= mbn->config.AcknowledgeRetries) {
+      /* send callback if the message timed out */
+      if(q->retries >= 0 && mbn->cb_AcknowledgeTimeout != NULL)
+        mbn->cb_AcknowledgeTimeout(mbn, &(q->msg));
+      /* remove item from the queue */
+      LCK();
+      if(last == mbn->queue) {
+        mbn->queue = last = q->next;
+      } else
+        last->next = q->next;
+      tmp = q;
+      q = q->next;
+      free_message(&(tmp->msg));
+      free(tmp);
+      ULCK();
+      continue;
+    }
+    /* Wait a sec if < 1. */
+    if(q->retries > 1) {
+      /* No reply yet, let's try again */
+      mbnSendMessage(mbn, &(q->msg), MBN_SEND_NOCREATE | MBN_SEND_FORCEID);
+    }
+    last = q;
+    q = q->next;
+  }
+  PULCK();
+}
+
+
 /* thread that keeps track of messages requiring an acknowledge reply,
- * and retries the message after a timeout (of one second, currently) */
+ * and retries the message after a timeout (of one second, currently).
+ * Shared by all nodes on the interface. */
 void *msgqueue_thread(void *arg) {
-  struct mbn_handler *mbn = (struct mbn_handler *) arg;
-  struct mbn_msgqueue *q, *last, *tmp;
+  struct mbn_handler *mbn = (struct mbn_handler *) arg, *m;
+  int state;
 #ifndef MBNP_mingw
   struct timeval delay;
   int RetVal;
@@ -68,36 +108,16 @@ void *msgqueue_thread(void *arg) {
 
   mbn->msgqueue_run = 1;
 
-  /* this is the only thread that can free() items from the msgqueue list,
-   * so we don't have to lock while reading from it */
   while(1) {
-    for(q=last=mbn->queue; q!=NULL; ) {
-      /* Remove item from the list */
-      if(q->retries == -1 || q->retries++ >= MBN_ACKNOWLEDGE_RETRIES) {
-        /* send callback if the message timed out */
-        if(q->retries >= 0 && mbn->cb_AcknowledgeTimeout != NULL)
-          mbn->cb_AcknowledgeTimeout(mbn, &(q->msg));
-        /* remove item from the queue */
-        LCK();
-        if(last == mbn->queue) {
-          mbn->queue = last = q->next;
-        } else
-          last->next = q->next;
-        tmp = q;
-        q = q->next;
-        free_message(&(tmp->msg));
-        free(tmp);
-        ULCK();
-        continue;
-      }
-      /* Wait a sec if < 1. */
-      if(q->retries > 1) {
-        /* No reply yet, let's try again */
-        mbnSendMessage(mbn, &(q->msg), MBN_SEND_NOCREATE | MBN_SEND_FORCEID);
-      }
-      last = q;
-      q = q->next;
-    }
+    /* don't get cancelled while holding the lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    GLCK();
+    mbnStartBatch(mbn);
+    for(m=mbn; m!=NULL; m=m->next)
+      process_msgqueue(m);
+    mbnFlushBatch(mbn);
+    GULCK();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
 
     pthread_testcancel();
 #ifdef MBNP_mingw
@@ -114,9 +134,169 @@ void *msgqueue_thread(void *arg) {
 }
 
 
+/* Hands the frames in the transmit batch of the interface to the
+ * interface module, TXLCK() should be held. */
+void flush_transmit(struct mbn_handler *mbn) {
+  struct mbn_handler *p = mbn->itf->mbn;
+  char err[MBN_ERRSIZE];
+  int i, r = 0;
+
+  if(p->txcount == 0 || p->txflushing)
+    return;
+
+  /* frames sent from within the transmit callbacks bypass the batch */
+  p->txflushing = 1;
+  if(mbn->itf->cb_transmit_batch != NULL)
+    r = mbn->itf->cb_transmit_batch(mbn->itf, p->txframes, p->txcount, err);
+  else
+    for(i=0; i<p->txcount && r == 0; i++)
+      r = mbn->itf->cb_transmit(mbn->itf, p->txframes[i].buffer, p->txframes[i].length, p->txframes[i].ifaddr, err);
+  p->txcount = 0;
+  p->txflushing = 0;
+
+  if(r != 0 && p->cb_Error)
+    p->cb_Error(p, MBN_ERROR_ITF_WRITE, err);
+}
+
+
+/* Sends a frame to the interface, or adds it to the transmit batch
+ * when a batch has been started or a coalescing window is used */
+void transmit_frame(struct mbn_handler *mbn, unsigned char *buffer, int length, void *ifaddr) {
+  struct mbn_handler *p = mbn->itf->mbn;
+  char err[MBN_ERRSIZE];
+
+  TXLCK();
+  /* frames that don't fit in a slot of the batch are sent right away,
+   * after the frames that are already waiting to keep them in order */
+  if((p->txdepth > 0 || p->config.TransmitWindow > 0) && !p->txflushing && length > MBN_MAX_MESSAGE_SIZE)
+    flush_transmit(mbn);
+  else if((p->txdepth > 0 || p->config.TransmitWindow > 0) && !p->txflushing) {
+    memcpy((void *)p->txframes[p->txcount].buffer, (void *)buffer, length);
+    p->txframes[p->txcount].length = length;
+    p->txframes[p->txcount].ifaddr = ifaddr;
+    if(++p->txcount == MBN_TX_BATCH)
+      flush_transmit(mbn);
+    else if(p->txcount == 1 && p->txdepth == 0)
+      pthread_cond_signal((pthread_cond_t *)p->tx_cond);
+    TXULCK();
+    return;
+  }
+  TXULCK();
+
+  if(mbn->itf->cb_transmit(mbn->itf, buffer, length, ifaddr, err) != 0) {
+    if(mbn->cb_Error)
+      mbn->cb_Error(mbn, MBN_ERROR_ITF_WRITE, err);
+  }
+}
+
+
+/* thread that flushes the transmit batch when the coalescing window
+ * has passed, only running when a window has been configured */
+void *transmit_thread(void *arg) {
+  struct mbn_handler *mbn = (struct mbn_handler *) arg;
+#ifndef MBNP_mingw
+  struct timeval tv;
+#endif
+
+  TXLCK();
+  while(!mbn->txstop) {
+    /* wait for the first frame of a batch */
+    if(mbn->txcount == 0 || mbn->txdepth > 0) {
+      pthread_cond_wait((pthread_cond_t *)mbn->tx_cond, (pthread_mutex_t *)mbn->tx_mutex);
+      continue;
+    }
+    TXULCK();
+#ifdef MBNP_mingw
+    Sleep((mbn->config.TransmitWindow+999)/1000);
+#else
+    tv.tv_sec = mbn->config.TransmitWindow/1000000;
+    tv.tv_usec = mbn->config.TransmitWindow%1000000;
+    select(0, NULL, NULL, NULL, &tv);
+#endif
+    TXLCK();
+    if(mbn->txdepth == 0)
+      flush_transmit(mbn);
+  }
+  TXULCK();
+  return NULL;
+}
+
+
+/* frees the copies of the objects made by mbnInitConfig() */
+void free_objects(struct mbn_handler *mbn) {
+  int i;
+
+  for(i=0; i<mbn->node.NumberOfObjects; i++) {
+    if(mbn->objects[i].SensorSize > 0) {
+      free_datatype(MMTYPE(mbn->objects[i].SensorType), &(mbn->objects[i].SensorMin));
+      free_datatype(MMTYPE(mbn->objects[i].SensorType), &(mbn->objects[i].SensorMax));
+      free_datatype(mbn->objects[i].SensorType, &(mbn->objects[i].SensorData));
+    }
+    if(mbn->objects[i].ActuatorSize > 0) {
+      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorMin));
+      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorMax));
+      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorDefault));
+      free_datatype(mbn->objects[i].ActuatorType, &(mbn->objects[i].ActuatorData));
+    }
+  }
+  free(mbn->objects);
+}
+
+
+/* Undoes mbnInitConfig() for the first node of an interface when one of
+ * its threads couldn't be created: the first 'threads' of the timeout,
+ * throttle and msgqueue threads are running. The interface is stopped
+ * if it had been started, and can be used for an other node again. */
+void abort_init(struct mbn_handler *mbn, int threads) {
+  pthread_t *thread[3];
+  int i;
+
+  thread[0] = (pthread_t *)mbn->timeout_thread;
+  thread[1] = (pthread_t *)mbn->throttle_thread;
+  thread[2] = (pthread_t *)mbn->msgqueue_thread;
+  for(i=0; i<threads; i++)
+    pthread_cancel(*thread[i]);
+  for(i=0; i<threads; i++)
+    pthread_join(*thread[i], NULL);
+  for(i=0; i<3; i++)
+    free(thread[i]);
+
+  if(mbn->itf->started && mbn->itf->cb_stop != NULL)
+    mbn->itf->cb_stop(mbn->itf);
+  mbn->itf->started = 0;
+  mbn->itf->mbn = NULL;
+
+  if(mbn->tx_cond != NULL) {
+    pthread_cond_destroy((pthread_cond_t *)mbn->tx_cond);
+    free(mbn->tx_cond);
+    free(mbn->tx_thread);
+  }
+  free_addresses(mbn);
+  free_objects(mbn);
+  pthread_mutex_destroy((pthread_mutex_t *)mbn->mbn_mutex);
+  free(mbn->mbn_mutex);
+  pthread_mutex_destroy((pthread_mutex_t *)mbn->proc_mutex);
+  free(mbn->proc_mutex);
+  pthread_rwlock_destroy((pthread_rwlock_t *)mbn->group_lock);
+  free(mbn->group_lock);
+  pthread_mutex_destroy((pthread_mutex_t *)mbn->tx_mutex);
+  free(mbn->tx_mutex);
+  free(mbn->txframes[0].buffer);
+  free(mbn->txframes);
+  free(mbn);
+}
+
+
 struct mbn_handler * MBN_EXPORT mbnInit(struct mbn_node_info *node, struct mbn_object *objects, struct mbn_interface *itf, char *err) {
-  struct mbn_handler *mbn;
+  return mbnInitConfig(node, objects, itf, NULL, err);
+}
+
+
+struct mbn_handler * MBN_EXPORT mbnInitConfig(struct mbn_node_info *node, struct mbn_object *objects, struct mbn_interface *itf, struct mbn_config *config, char *err) {
+  struct mbn_handler *mbn, *m;
   struct mbn_object *obj;
+  struct mbn_config cfg;
+  pthread_mutexattr_t attr;
   int i, l;
 
 #ifdef PTW32_STATIC_LIB
@@ -129,6 +309,46 @@ struct mbn_handler * MBN_EXPORT mbnInit(struct mbn_node_info *node, struct mbn_o
     return NULL;
   }
 
+  /* fill in the defaults and check the configuration */
+  if(config != NULL)
+    memcpy((void *)&cfg, (void *)config, sizeof(struct mbn_config));
+  else
+    memset((void *)&cfg, 0, sizeof(struct mbn_config));
+  if(cfg.AddressTimeout == 0)
+    cfg.AddressTimeout = MBN_ADDR_TIMEOUT;
+  if(cfg.AddressMsgTimeout == 0)
+    cfg.AddressMsgTimeout = MBN_ADDR_MSG_TIMEOUT;
+  if(cfg.EngineAddressTimeout == 0)
+    cfg.EngineAddressTimeout = MBN_ENG_ADDR_TIMEOUT;
+  if(cfg.EngineAddressMsgTimeout == 0)
+    cfg.EngineAddressMsgTimeout = MBN_ENG_ADDR_MSG_TIMEOUT;
+  if(cfg.AcknowledgeRetries == 0)
+    cfg.AcknowledgeRetries = MBN_ACKNOWLEDGE_RETRIES;
+  if(cfg.ThrottleTick == 0)
+    cfg.ThrottleTick = MBN_THROTTLE_TICK;
+  if(cfg.TransmitWindow == 0)
+    cfg.TransmitWindow = MBN_TX_WINDOW;
+  if(cfg.AddressMsgTimeout < 0 || cfg.AddressTimeout <= cfg.AddressMsgTimeout) {
+    sprintf(err, "AddressTimeout must be larger than AddressMsgTimeout");
+    return NULL;
+  }
+  if(cfg.EngineAddressMsgTimeout < 0 || cfg.EngineAddressTimeout <= cfg.EngineAddressMsgTimeout) {
+    sprintf(err, "EngineAddressTimeout must be larger than EngineAddressMsgTimeout");
+    return NULL;
+  }
+  if(cfg.AcknowledgeRetries < 0) {
+    sprintf(err, "Invalid number of acknowledge retries: %d", cfg.AcknowledgeRetries);
+    return NULL;
+  }
+  if(cfg.ThrottleTick < 0 || cfg.ThrottleTick > 1000) {
+    sprintf(err, "ThrottleTick must be between 1 and 1000 ms");
+    return NULL;
+  }
+  if(cfg.TransmitWindow < 0 || cfg.TransmitWindow >= 1000000) {
+    sprintf(err, "TransmitWindow must be less than a second");
+    return NULL;
+  }
+
 #ifdef MBN_MANUFACTURERID
   if(node->ManufacturerID != 0xFFFF && node->ManufacturerID != MBN_MANUFACTURERID) {
     sprintf(err, "This library has been built to only allow ManufacturerID %d", MBN_MANUFACTURERID);
@@ -139,8 +359,10 @@ struct mbn_handler * MBN_EXPORT mbnInit(struct mbn_node_info *node, struct mbn_o
   mbn = (struct mbn_handler *) calloc(1, sizeof(struct mbn_handler));
   memcpy((void *)&(mbn->node), (void *)node, sizeof(struct mbn_node_info));
   mbn->node.Services &= 0x7F; /* turn off validated bit */
+  memcpy((void *)&(mbn->config), (void *)&cfg, sizeof(struct mbn_config));
   mbn->itf = itf;
-  itf->mbn = mbn;
+  if(itf->mbn == NULL)
+    itf->mbn = mbn;
 
   /* pad descriptions and name with zero and clear some other things */
   l = strlen(mbn->node.Description);
@@ -177,42 +399,265 @@ struct mbn_handler * MBN_EXPORT mbnInit(struct mbn_node_info *node, struct mbn_o
     mbn->node.NumberOfObjects = 0;
 
   /* init and allocate some pthread objects */
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
   mbn->mbn_mutex = malloc(sizeof(pthread_mutex_t));
-  mbn->timeout_thread = malloc(sizeof(pthread_t));
-  mbn->throttle_thread = malloc(sizeof(pthread_t));
-  mbn->msgqueue_thread = malloc(sizeof(pthread_t));
   pthread_mutex_init((pthread_mutex_t *) mbn->mbn_mutex, NULL);
+  mbn->proc_mutex = malloc(sizeof(pthread_mutex_t));
+  pthread_mutex_init((pthread_mutex_t *) mbn->proc_mutex, &attr);
 
   /* initialize address list */
   init_addresses(mbn);
 
+  /* the interface is already used by an other node, so this becomes a
+   * virtual node sharing the interface and threads of the first node */
+  if(itf->mbn != mbn) {
+    pthread_mutexattr_destroy(&attr);
+    GWLCK();
+    for(m=itf->mbn; m->next!=NULL; m=m->next)
+      ;
+    m->next = mbn;
+    mbn->started = itf->mbn->started;
+    if(mbn->started)
+      start_join(mbn);
+    GULCK();
+    return mbn;
+  }
+
+  mbn->group_lock = malloc(sizeof(pthread_rwlock_t));
+  pthread_rwlock_init((pthread_rwlock_t *) mbn->group_lock, NULL);
+  mbn->tx_mutex = malloc(sizeof(pthread_mutex_t));
+  pthread_mutex_init((pthread_mutex_t *) mbn->tx_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  /* transmit batch */
+  mbn->txframes = (struct mbn_txframe *) calloc(MBN_TX_BATCH, sizeof(struct mbn_txframe));
+  mbn->txframes[0].buffer = (unsigned char *) malloc(MBN_TX_BATCH*MBN_MAX_MESSAGE_SIZE);
+  for(i=1; i<MBN_TX_BATCH; i++)
+    mbn->txframes[i].buffer = mbn->txframes[0].buffer+i*MBN_MAX_MESSAGE_SIZE;
+
+  mbn->timeout_thread = malloc(sizeof(pthread_t));
+  mbn->throttle_thread = malloc(sizeof(pthread_t));
+  mbn->msgqueue_thread = malloc(sizeof(pthread_t));
+
   /* create threads to keep track of timeouts */
+  l = 0;
   if(    (i = pthread_create((pthread_t *)mbn->timeout_thread,  NULL, node_timeout_thread, (void *) mbn)) != 0
-      || (i = pthread_create((pthread_t *)mbn->throttle_thread, NULL, throttle_thread,     (void *) mbn)) != 0
-      || (i = pthread_create((pthread_t *)mbn->msgqueue_thread, NULL, msgqueue_thread,     (void *) mbn)) != 0) {
-    sprintf("Can't create thread: %s (%d)", strerror(i), i);
-    free(mbn);
+      || (l++, i = pthread_create((pthread_t *)mbn->throttle_thread, NULL, throttle_thread,     (void *) mbn)) != 0
+      || (l++, i = pthread_create((pthread_t *)mbn->msgqueue_thread, NULL, msgqueue_thread,     (void *) mbn)) != 0) {
+    sprintf(err, "Can't create thread: %s (%d)", strerror(i), i);
+    abort_init(mbn, l);
     return NULL;
   }
 
+  /* only flush batches from a separate thread when we have to */
+  if(mbn->config.TransmitWindow > 0) {
+    mbn->tx_cond = malloc(sizeof(pthread_cond_t));
+    pthread_cond_init((pthread_cond_t *) mbn->tx_cond, NULL);
+    mbn->tx_thread = malloc(sizeof(pthread_t));
+    if((i = pthread_create((pthread_t *)mbn->tx_thread, NULL, transmit_thread, (void *) mbn)) != 0) {
+      sprintf(err, "Can't create thread: %s (%d)", strerror(i), i);
+      abort_init(mbn, 3);
+      return NULL;
+    }
+  }
+
   return mbn;
 }
 
+/* Called by the mbn*OpenConfig() functions: itf->config should hold the
+ * defaults of the interface, these are overwritten with the non-zero
+ * fields of config, after which the configuration is checked. */
+int MBN_EXPORT mbnInterfaceConfig(struct mbn_interface *itf, struct mbn_if_config *config, char *err) {
+  if(config != NULL) {
+    if(config->BufferSize != 0)
+      itf->config.BufferSize = config->BufferSize;
+    if(config->MaxConnections != 0)
+      itf->config.MaxConnections = config->MaxConnections;
+    if(config->AddressListSize != 0)
+      itf->config.AddressListSize = config->AddressListSize;
+    /* watermarks scale along with the queue size, unless given */
+    if(config->SendQueueSize != 0 && itf->config.SendQueueSize > 0) {
+      itf->config.SendQueueHigh = (int)((double)itf->config.SendQueueHigh*config->SendQueueSize/itf->config.SendQueueSize);
+      itf->config.SendQueueLow = (int)((double)itf->config.SendQueueLow*config->SendQueueSize/itf->config.SendQueueSize);
+    }
+    if(config->SendQueueSize != 0)
+      itf->config.SendQueueSize = config->SendQueueSize;
+    if(config->SendQueueHigh != 0)
+      itf->config.SendQueueHigh = config->SendQueueHigh;
+    if(config->SendQueueLow != 0)
+      itf->config.SendQueueLow = config->SendQueueLow;
+    if(config->SlowConsumer != 0)
+      itf->config.SlowConsumer = config->SlowConsumer;
+    if(config->ConnectTimeout != 0)
+      itf->config.ConnectTimeout = config->ConnectTimeout;
+    if(config->ReconnectDelay != 0)
+      itf->config.ReconnectDelay = config->ReconnectDelay;
+    if(config->ReconnectMaxDelay != 0)
+      itf->config.ReconnectMaxDelay = config->ReconnectMaxDelay;
+    if(config->Threads != 0)
+      itf->config.Threads = config->Threads;
+    if(config->ForwardTimeout != 0)
+      itf->config.ForwardTimeout = config->ForwardTimeout;
+    if(config->DuplicateWindow != 0)
+      itf->config.DuplicateWindow = config->DuplicateWindow;
+    if(config->BatchSize != 0)
+      itf->config.BatchSize = config->BatchSize;
+    if(config->PacketSize != 0)
+      itf->config.PacketSize = config->PacketSize;
+    if(config->RingSize != 0)
+      itf->config.RingSize = config->RingSize;
+    if(config->Loopback != 0)
+      itf->config.Loopback = config->Loopback;
+  }
+
+  if(itf->config.BufferSize < MBN_MAX_MESSAGE_SIZE) {
+    sprintf(err, "BufferSize must be at least %d bytes", MBN_MAX_MESSAGE_SIZE);
+    return 1;
+  }
+  if(itf->config.MaxConnections < 0 || itf->config.AddressListSize < 0) {
+    sprintf(err, "Invalid interface table size");
+    return 1;
+  }
+  if(itf->config.SendQueueSize != 0 && (itf->config.SendQueueSize < MBN_MAX_MESSAGE_SIZE
+      || itf->config.SendQueueHigh > itf->config.SendQueueSize || itf->config.SendQueueLow < 0
+      || itf->config.SendQueueLow >= itf->config.SendQueueHigh)) {
+    sprintf(err, "Invalid send queue size or watermarks");
+    return 1;
+  }
+  if(itf->config.SlowConsumer < 0 || itf->config.SlowConsumer > MBN_SLOWCONSUMER_COALESCE) {
+    sprintf(err, "Unknown slow consumer policy");
+    return 1;
+  }
+  if(itf->config.ConnectTimeout < 0 || itf->config.ReconnectDelay < 0
+      || itf->config.ReconnectMaxDelay < itf->config.ReconnectDelay) {
+    sprintf(err, "Invalid connect time-out or reconnect delay");
+    return 1;
+  }
+  if(itf->config.Threads < 0) {
+    sprintf(err, "Invalid number of receiver threads");
+    return 1;
+  }
+  if(itf->config.ForwardTimeout < 0) {
+    sprintf(err, "Invalid forwarding time-out");
+    return 1;
+  }
+  if(itf->config.BatchSize < 0) {
+    sprintf(err, "Invalid batch size");
+    return 1;
+  }
+  return 0;
+}
+
+
+int MBN_EXPORT mbnInterfaceQueueStatus(struct mbn_interface *itf, void *ifaddr, struct mbn_queue_status *status) {
+  memset((void *)status, 0, sizeof(struct mbn_queue_status));
+  if(itf->cb_queue_status == NULL)
+    return 1;
+  return itf->cb_queue_status(itf, ifaddr, status);
+}
+
+
+/* Number of received broadcasts the interface dropped because it had
+ * seen them just before (see DuplicateWindow in mbn_if_config) */
+unsigned long MBN_EXPORT mbnInterfaceDuplicates(struct mbn_interface *itf) {
+  return itf->duplicates;
+}
+
+
+/* Gives up on the messages of a node that wait for an acknowledge reply
+ * from a node behind ifaddr (from any node if ifaddr is NULL), as if
+ * they timed out. The msgqueue thread frees them. */
+void fail_msgqueue(struct mbn_handler *mbn, void *ifaddr) {
+  struct mbn_msgqueue *q;
+  struct mbn_address_node *dest;
+  struct mbn_message msg;
+
+  while(1) {
+    LCK();
+    for(q=mbn->queue; q!=NULL; q=q->next) {
+      if(q->retries < 0)
+        continue;
+      if(ifaddr == NULL || ((dest = mbnNodeStatus(mbn, q->msg.AddressTo)) != NULL && dest->ifaddr == ifaddr))
+        break;
+    }
+    if(q == NULL) {
+      ULCK();
+      return;
+    }
+    copy_message(&(q->msg), &msg);
+    q->retries = -1;
+    ULCK();
+
+    if(mbn->cb_AcknowledgeTimeout != NULL)
+      mbn->cb_AcknowledgeTimeout(mbn, &msg);
+    free_message(&msg);
+  }
+}
+
+
+/* Called by interface modules when a connection they maintain changes
+ * state. When it comes (back) up, the nodes announce themselves right
+ * away, so the other side doesn't have to wait for the next info message.
+ * When it goes down, the messages to the nodes behind it that wait for
+ * an acknowledge reply fail right away instead of after their retries. */
+void MBN_EXPORT mbnInterfaceConnectionState(struct mbn_interface *itf, void *ifaddr, int state) {
+  struct mbn_handler *mbn = itf->mbn, *m;
+  int cancel;
+
+  if(mbn == NULL)
+    return;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+  GLCK();
+  if(state == MBN_CONNECTION_UP)
+    for(m=mbn; m!=NULL; m=m->next) {
+      if(!m->started)
+        continue;
+      if(m->node.Services & MBN_ADDR_SERVICES_VALID)
+        send_info(m);
+      else
+        start_join(m);
+    }
+  if(state == MBN_CONNECTION_DOWN)
+    for(m=mbn; m!=NULL; m=m->next)
+      if(m->started)
+        fail_msgqueue(m, ifaddr);
+  if(mbn->cb_ConnectionState)
+    mbn->cb_ConnectionState(mbn, ifaddr, state);
+  GULCK();
+  pthread_setcancelstate(cancel, &cancel);
+}
+
+
 void MBN_EXPORT mbnStartInterface(struct mbn_interface *itf, char *err) {
+  struct mbn_handler *mbn, *m;
+
   /* init interface */
-  if(itf->cb_init != NULL)
-  {
-    itf->cb_init(itf, err);
+  if(itf->cb_init != NULL && itf->cb_init(itf, err) != 0)
+    return;
+  itf->started = 1;
+
+  /* interface is up, announce ourselves right away */
+  if((mbn = itf->mbn) != NULL) {
+    GLCK();
+    for(m=mbn; m!=NULL; m=m->next) {
+      m->started = 1;
+      start_join(m);
+    }
+    GULCK();
   }
 }
 
 /* IMPORTANT: must not be called in a thread which has a lock on mbn_mutex */
 void MBN_EXPORT mbnFree(struct mbn_handler *mbn) {
+  struct mbn_handler *m;
   int i;
 
   /* disable all callbacks so the application won't see all kinds of activities
    * while we're freeing everything */
   mbn->cb_ReceiveMessage = NULL;
+  mbn->cb_ReceiveRawMessage = NULL;
   mbn->cb_AddressTableChange = NULL;
   mbn->cb_WriteLogMessage = NULL;
   mbn->cb_OnlineStatus = NULL;
@@ -231,59 +676,91 @@ void MBN_EXPORT mbnFree(struct mbn_handler *mbn) {
   mbn->cb_AcknowledgeTimeout = NULL;
   mbn->cb_AcknowledgeReply = NULL;
 
-  /* wait for the threads to be running
-   * (normally they should be running right after mbnInit(),
-   *  but there can be some slight lag on pthread-win32) */
-  for(i=0; !mbn->msgqueue_run || !mbn->timeout_run || !mbn->throttle_run; i++) {
-    if(i > 10)
-      break; /* shouldn't happen, but silently ignore if it somehow does. */
-    sleep(1);
+  /* virtual node, only remove it from the list of nodes on the interface */
+  if(mbn->itf->mbn != mbn) {
+    GWLCK();
+    for(m=mbn->itf->mbn; m->next!=mbn; m=m->next)
+      ;
+    m->next = mbn->next;
+    GULCK();
   }
 
-  /* Stop the interface receiving */
-  if(mbn->itf->cb_stop != NULL)
-    mbn->itf->cb_stop(mbn->itf);
+  /* the interface and threads are ours, free the virtual nodes and stop everything */
+  else {
+    while(mbn->next != NULL)
+      mbnFree(mbn->next);
+
+    /* wait for the threads to be running
+     * (normally they should be running right after mbnInit(),
+     *  but there can be some slight lag on pthread-win32) */
+    for(i=0; !mbn->msgqueue_run || !mbn->timeout_run || !mbn->throttle_run; i++) {
+      if(i > 10)
+        break; /* shouldn't happen, but silently ignore if it somehow does. */
+      sleep(1);
+    }
 
-  /* request cancellation for the threads */
-  pthread_cancel(*((pthread_t *)mbn->timeout_thread));
-  pthread_cancel(*((pthread_t *)mbn->throttle_thread));
-  pthread_cancel(*((pthread_t *)mbn->msgqueue_thread));
+    /* Stop the interface receiving */
+    if(mbn->itf->cb_stop != NULL)
+      mbn->itf->cb_stop(mbn->itf);
+
+    /* request cancellation for the threads */
+    pthread_cancel(*((pthread_t *)mbn->timeout_thread));
+    pthread_cancel(*((pthread_t *)mbn->throttle_thread));
+    pthread_cancel(*((pthread_t *)mbn->msgqueue_thread));
+
+    /* wait for the threads
+     * (make sure no locks on mbn->mbn_mutex are present here) */
+    pthread_join(*((pthread_t *)mbn->timeout_thread), NULL);
+    pthread_join(*((pthread_t *)mbn->throttle_thread), NULL);
+    pthread_join(*((pthread_t *)mbn->msgqueue_thread), NULL);
+    free(mbn->timeout_thread);
+    free(mbn->throttle_thread);
+    free(mbn->msgqueue_thread);
+
+    /* the transmit thread isn't cancelled, as it waits on a condition */
+    if(mbn->tx_thread != NULL) {
+      TXLCK();
+      mbn->txstop = 1;
+      pthread_cond_signal((pthread_cond_t *)mbn->tx_cond);
+      TXULCK();
+      pthread_join(*((pthread_t *)mbn->tx_thread), NULL);
+      pthread_cond_destroy((pthread_cond_t *)mbn->tx_cond);
+      free(mbn->tx_thread);
+      free(mbn->tx_cond);
+    }
 
-  /* wait for the threads
-   * (make sure no locks on mbn->mbn_mutex are present here) */
-  pthread_join(*((pthread_t *)mbn->timeout_thread), NULL);
-  pthread_join(*((pthread_t *)mbn->throttle_thread), NULL);
-  pthread_join(*((pthread_t *)mbn->msgqueue_thread), NULL);
-  free(mbn->timeout_thread);
-  free(mbn->throttle_thread);
-  free(mbn->msgqueue_thread);
+    /* send whatever is left in the transmit batch */
+    TXLCK();
+    mbn->txdepth = 0;
+    flush_transmit(mbn);
+    TXULCK();
+  }
 
   /* free address list */
+  GLCK();
   free_addresses(mbn);
+  GULCK();
 
   /* free interface */
-  if(mbn->itf->cb_free != NULL)
+  if(mbn->itf->mbn == mbn && mbn->itf->cb_free != NULL)
     mbn->itf->cb_free(mbn->itf);
 
   /* free objects */
-  for(i=0; i<mbn->node.NumberOfObjects; i++) {
-    if(mbn->objects[i].SensorSize > 0) {
-      free_datatype(MMTYPE(mbn->objects[i].SensorType), &(mbn->objects[i].SensorMin));
-      free_datatype(MMTYPE(mbn->objects[i].SensorType), &(mbn->objects[i].SensorMax));
-      free_datatype(mbn->objects[i].SensorType, &(mbn->objects[i].SensorData));
-    }
-    if(mbn->objects[i].ActuatorSize > 0) {
-      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorMin));
-      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorMax));
-      free_datatype(MMTYPE(mbn->objects[i].ActuatorType), &(mbn->objects[i].ActuatorDefault));
-      free_datatype(mbn->objects[i].ActuatorType, &(mbn->objects[i].ActuatorData));
-    }
-  }
-  free(mbn->objects);
+  free_objects(mbn);
 
-  /* and get rid of our mutex */
+  /* and get rid of our mutexes */
   pthread_mutex_destroy((pthread_mutex_t *)mbn->mbn_mutex);
   free(mbn->mbn_mutex);
+  pthread_mutex_destroy((pthread_mutex_t *)mbn->proc_mutex);
+  free(mbn->proc_mutex);
+  if(mbn->group_lock != NULL) {
+    pthread_rwlock_destroy((pthread_rwlock_t *)mbn->group_lock);
+    free(mbn->group_lock);
+    pthread_mutex_destroy((pthread_mutex_t *)mbn->tx_mutex);
+    free(mbn->tx_mutex);
+    free(mbn->txframes[0].buffer);
+    free(mbn->txframes);
+  }
   free(mbn);
 
 #ifdef PTW32_STATIC_LIB
@@ -344,53 +821,97 @@ int process_acknowledge_reply(struct mbn_handler *mbn, struct mbn_message *msg)
 }
 
 
-/* Entry point for all incoming MambaNet messages */
-void MBN_EXPORT mbnProcessRawMessage(struct mbn_interface *itf, unsigned char *buffer, int length, void *ifaddr) {
-  struct mbn_handler *mbn = itf->mbn;
-  int r, processed = 0;
-  struct mbn_message msg;
-  char err[MBN_ERRSIZE];
-
-  memset((void *)&msg, 0, sizeof(struct mbn_message));
-  msg.raw = buffer;
-  msg.rawlength = length;
+/* Handles an incoming message for a single node, messages for different
+ * nodes can be handled by several receiver threads at the same time */
+void process_message(struct mbn_handler *mbn, struct mbn_message *msg, void *ifaddr) {
+  int processed = 0;
 
-  /* parse message */
-  if((r = parse_message(&msg)) != 0) {
-    if(mbn->cb_Error) {
-      sprintf(err, "Couldn't parse incoming message (%d)", r);
-      mbn->cb_Error(mbn, MBN_ERROR_PARSE_MESSAGE, err);
-    }
-    return;
-  }
+  PLCK();
 
   /* Oh my, the interface is echoing back packets, let's ignore them */
-  if((mbn->node.Services & MBN_ADDR_SERVICES_VALID) && msg.AddressFrom == mbn->node.MambaNetAddr)
+  if((mbn->node.Services & MBN_ADDR_SERVICES_VALID) && msg->AddressFrom == mbn->node.MambaNetAddr)
+    processed++;
+
+  /* drop address information packets when we're flooded with them */
+  if(!processed && limit_address_info(mbn, msg, ifaddr) != 0)
     processed++;
 
   /* send ReceiveMessage() callback, and stop processing if it returned non-zero */
-  if(!processed && mbn->cb_ReceiveMessage != NULL && mbn->cb_ReceiveMessage(mbn, &msg) != 0)
+  if(!processed && mbn->cb_ReceiveMessage != NULL && mbn->cb_ReceiveMessage(mbn, msg) != 0)
     processed++;
 
   /* handle address reservation messages */
-  if(!processed && process_address_message(mbn, &msg, ifaddr) != 0)
+  if(!processed && process_address_message(mbn, msg, ifaddr) != 0)
     processed++;
 
   /* we can't handle any other messages if we don't have a validated address */
   if(!(mbn->node.Services & MBN_ADDR_SERVICES_VALID))
     processed++;
   /* ...or if it's not targeted at us */
-  if(msg.AddressTo != MBN_BROADCAST_ADDRESS && msg.AddressTo != mbn->node.MambaNetAddr)
+  if(msg->AddressTo != MBN_BROADCAST_ADDRESS && msg->AddressTo != mbn->node.MambaNetAddr)
     processed++;
 
   /* acknowledge reply, yay! */
-  if(!processed && process_acknowledge_reply(mbn, &msg) != 0)
+  if(!processed && process_acknowledge_reply(mbn, msg) != 0)
     processed++;
 
   /* object messages */
-  if(!processed && process_object_message(mbn, &msg) != 0)
+  if(!processed && process_object_message(mbn, msg) != 0)
     processed++;
 
+  PULCK();
+}
+
+
+/* Entry point for all incoming MambaNet messages */
+void MBN_EXPORT mbnProcessRawMessage(struct mbn_interface *itf, unsigned char *buffer, int length, void *ifaddr) {
+  struct mbn_handler *mbn = itf->mbn, *m;
+  int r, state;
+  struct mbn_message msg;
+  char err[MBN_ERRSIZE];
+
+  /* let the application see (and take) the frame before we parse it */
+  if(mbn->cb_ReceiveRawMessage != NULL && mbn->cb_ReceiveRawMessage(mbn, buffer, length, ifaddr) != 0)
+    return;
+
+  memset((void *)&msg, 0, sizeof(struct mbn_message));
+  msg.raw = buffer;
+  msg.rawlength = length;
+
+  /* parse message */
+  if((r = parse_message(&msg)) != 0) {
+    if(mbn->cb_Error) {
+      sprintf(err, "Couldn't parse incoming message (%d)", r);
+      mbn->cb_Error(mbn, MBN_ERROR_PARSE_MESSAGE, err);
+    }
+    return;
+  }
+
+  /* don't get cancelled while holding the lock, which only keeps the list of
+   * nodes from changing, the nodes themselves are locked by process_message() */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+  GLCK();
+
+  /* look for the (virtual) node the message is addressed to */
+  m = NULL;
+  if(msg.AddressTo != MBN_BROADCAST_ADDRESS)
+    for(m=mbn; m!=NULL; m=m->next)
+      if((m->node.Services & MBN_ADDR_SERVICES_VALID) && m->node.MambaNetAddr == msg.AddressTo)
+        break;
+
+  if(m != NULL)
+    process_message(m, &msg, ifaddr);
+  /* broadcasts and address messages for nodes without a valid address go to all nodes */
+  else if(msg.AddressTo == MBN_BROADCAST_ADDRESS || msg.MessageType == MBN_MSGTYPE_ADDRESS)
+    for(m=mbn; m!=NULL; m=m->next)
+      process_message(m, &msg, ifaddr);
+  /* anything else only to the first, as if there were no virtual nodes */
+  else
+    process_message(mbn, &msg, ifaddr);
+
+  GULCK();
+  pthread_setcancelstate(state, &state);
+
   free_message(&msg);
 }
 
@@ -421,10 +942,7 @@ void MBN_EXPORT mbnSendMessage(struct mbn_handler *mbn, struct mbn_message *msg,
 
   /* just forward the raw data to the interface, if we don't need to do any processing */
   if(flags & MBN_SEND_RAWDATA) {
-    if(mbn->itf->cb_transmit(mbn->itf, raw, msg->rawlength, NULL, err) != 0) {
-      if(mbn->cb_Error)
-        mbn->cb_Error(mbn, MBN_ERROR_ITF_WRITE, err);
-    }
+    transmit_frame(mbn, msg->raw, msg->rawlength, NULL);
     return;
   }
 
@@ -505,10 +1023,43 @@ void MBN_EXPORT mbnSendMessage(struct mbn_handler *mbn, struct mbn_message *msg,
   }
 
   /* send the data to the interface transmit callback */
-  if(mbn->itf->cb_transmit(mbn->itf, raw, msg->rawlength, ifaddr, err) != 0) {
-    if(mbn->cb_Error)
-      mbn->cb_Error(mbn, MBN_ERROR_ITF_WRITE, err);
+  transmit_frame(mbn, raw, msg->rawlength, ifaddr);
+}
+
+
+/* Sends a complete MambaNet frame as it is, to the interface address
+ * ifaddr or to everyone on the interface when ifaddr is NULL. Unlike
+ * mbnSendMessage() with MBN_SEND_RAWDATA, nothing is checked or copied
+ * (unless the frame is added to a transmit batch). */
+void MBN_EXPORT mbnSendRawMessage(struct mbn_handler *mbn, unsigned char *buffer, int length, void *ifaddr) {
+  char err[MBN_ERRSIZE];
+
+  if(mbn->itf->cb_transmit == NULL) {
+    if(mbn->cb_Error) {
+      sprintf(err, "Registered interface can't send messages");
+      mbn->cb_Error(mbn, MBN_ERROR_NO_INTERFACE, err);
+    }
+    return;
   }
+  transmit_frame(mbn, buffer, length, ifaddr);
+}
+
+
+/* Frames sent from now on are collected and handed to the interface at
+ * once by mbnFlushBatch(). Calls can be nested, the batch is only
+ * flushed by the outermost mbnFlushBatch(). */
+void MBN_EXPORT mbnStartBatch(struct mbn_handler *mbn) {
+  TXLCK();
+  mbn->itf->mbn->txdepth++;
+  TXULCK();
+}
+
+
+void MBN_EXPORT mbnFlushBatch(struct mbn_handler *mbn) {
+  TXLCK();
+  if(mbn->itf->mbn->txdepth > 0 && --mbn->itf->mbn->txdepth == 0)
+    flush_transmit(mbn);
+  TXULCK();
 }
 
 
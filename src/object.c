@@ -14,6 +14,7 @@
 **
 ****************************************************************************/
 
+#define _XOPEN_SOURCE 500 /* pthread_rwlock_t */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,8 +58,8 @@ void send_object_changed(struct mbn_handler *mbn, unsigned short obj) {
 }
 
 
-/* special thread to throttle sensor change messages */
-/* Timing info:
+/* checks the changed sensors of a node
+ * Timing info (with the default tick of 50ms, see mbn->config.ThrottleTick):
  *   S  Freq     Sec     timeout (*0.05s)
  *   2  25  Hz   0.04s    1   -> Actual max. frequency = 20Hz
  *   3  10  Hz   0.10s    2
@@ -69,50 +70,62 @@ void send_object_changed(struct mbn_handler *mbn, unsigned short obj) {
  * Note: this method of timing is not precise, actual send frequencies
  *  are likely lower, depening on CPU speed and kernel interrupt resolution
  */
+void throttle_objects(struct mbn_handler *mbn, int tick) {
+  int i, f;
+
+  /* no need to lock here, the only shared memory is
+   * mbn->objects[n].changed, which is just a synchronisation byte */
+  for(i=0; i<mbn->node.NumberOfObjects; i++) {
+    if(mbn->objects[i].timeout != 0) {
+      mbn->objects[i].timeout--;
+      continue;
+    }
+    if(!mbn->objects[i].changed)
+      continue;
+    /* we can send the message */
+    send_object_changed(mbn, i+1024);
+    /* reset the timeout (see timing info above for detailed explanation) */
+    f = mbn->objects[i].UpdateFrequency;
+    f = f == 2 ?   40 : f == 3 ?  100 :
+        f == 4 ?  200 : f == 5 ? 1000 :
+        f == 6 ? 5000 : f == 7 ? 10000 : 0;
+    mbn->objects[i].timeout = (f+tick-1)/tick;
+    mbn->objects[i].changed = 0;
+  }
+}
+
+
+/* special thread to throttle sensor change messages, shared by
+ * all nodes on the interface and using the tick of the first node */
 void *throttle_thread(void *arg) {
-  struct mbn_handler *mbn = (struct mbn_handler *) arg;
+  struct mbn_handler *mbn = (struct mbn_handler *) arg, *m;
 #ifndef MBNP_mingw
   struct timeval tv;
 #endif
-  int i, f;
+  int state;
 
   mbn->throttle_run = 1;
 
-  if(!mbn->objects)
-    return NULL;
-
   while(1) {
-    /* wait 50ms */
+    /* wait one tick */
 #ifdef MBNP_mingw
-    Sleep(50);
+    Sleep(mbn->config.ThrottleTick);
 #else
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
+    tv.tv_sec = mbn->config.ThrottleTick/1000;
+    tv.tv_usec = (mbn->config.ThrottleTick%1000)*1000;
     select(0, NULL, NULL, NULL, &tv);
 #endif
     pthread_testcancel();
 
-    /* no need to lock in this thread, the only shared memory is
-     * mbn->objects[n].changed, which is just a synchronisation byte */
-
-    /* check for changed sensors */
-    for(i=0; i<mbn->node.NumberOfObjects; i++) {
-      if(mbn->objects[i].timeout != 0) {
-        mbn->objects[i].timeout--;
-        continue;
-      }
-      if(!mbn->objects[i].changed)
-        continue;
-      /* we can send the message */
-      send_object_changed(mbn, i+1024);
-      /* reset the timeout (see timing info above for detailed explanation) */
-      f = mbn->objects[i].UpdateFrequency;
-      mbn->objects[i].timeout =
-        f == 2 ?   1 : f == 3 ?   2 :
-        f == 4 ?   4 : f == 5 ?  20 :
-        f == 6 ? 100 : f == 7 ? 200 : 0;
-      mbn->objects[i].changed = 0;
-    }
+    /* check for changed sensors, don't get cancelled while holding the lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    GLCK();
+    mbnStartBatch(mbn);
+    for(m=mbn; m!=NULL; m=m->next)
+      throttle_objects(m, mbn->config.ThrottleTick);
+    mbnFlushBatch(mbn);
+    GULCK();
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
   }
 
   return NULL;
@@ -0,0 +1,240 @@
+/****************************************************************************
+**
+** Copyright (C) 2009 D&R Electronica Weesp B.V. All rights reserved.
+**
+** This file is part of the Axum/MambaNet digital mixing system.
+**
+** This file may be used under the terms of the GNU General Public
+** License version 2.0 as published by the Free Software Foundation
+** and appearing in the file LICENSE.GPL included in the packaging of
+** this file.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbn.h"
+#include "sendq.h"
+#include "codec.h"
+
+
+void sendq_init(struct sendq *q, struct mbn_if_config *config) {
+  memset((void *)q, 0, sizeof(struct sendq));
+  q->size = config->SendQueueSize;
+  q->high = config->SendQueueHigh;
+  q->low = config->SendQueueLow;
+  q->policy = config->SlowConsumer;
+}
+
+
+/* Empties the queue and frees the buffer, called when the connection is closed */
+void sendq_clear(struct sendq *q) {
+  if(q->buf != NULL)
+    free(q->buf);
+  if(q->index != NULL)
+    free(q->index);
+  q->buf = NULL;
+  q->index = NULL;
+  q->start = q->length = q->frames = q->peak = 0;
+  q->partial = q->congested = 0;
+  q->sent = q->dropped = q->compacted = 0;
+}
+
+
+/* Drops the rest of a partly transmitted frame, but keeps all complete
+ * frames. Called when the connection has been re-established, so the
+ * new stream starts at a frame boundary */
+void sendq_restart(struct sendq *q) {
+  int len;
+
+  if(!q->partial)
+    return;
+  for(len=0; len < q->length && q->buf[(q->start+len)%q->size] != 0xFF; len++)
+    ;
+  len = len < q->length ? len+1 : q->length;
+  q->start = (q->start+len)%q->size;
+  q->length -= len;
+  q->frames--;
+  q->dropped++;
+  q->partial = 0;
+  if(q->congested && q->length <= q->low)
+    q->congested = 0;
+}
+
+
+/* Only the latest value of sensor changes and actuator updates matters,
+ * so these frames can replace older queued frames of the same object.
+ * Returns 0 and a hash of (AddressTo, AddressFrom, Object, Action) if the
+ * frame is one of those, acknowledge requests are never replaced. */
+int compact_key(unsigned char *buf, int length, unsigned long *hash) {
+  unsigned char data[4];
+  int i;
+
+  if(length < 20 || buf[12] != 0x00 || buf[13] != MBN_MSGTYPE_OBJECT || (buf[9]|buf[10]|buf[11]) != 0 || buf[14] < 4)
+    return 1;
+  convert_7to8bits(buf+15, 4, data);
+  if(data[2] != MBN_OBJ_ACTION_SENSOR_CHANGED && data[2] != MBN_OBJ_ACTION_SET_ACTUATOR)
+    return 1;
+
+  /* the addresses are part of the key, different nodes have the same object numbers */
+  *hash = 5381;
+  for(i=0; i<9; i++)
+    *hash = *hash*33 + buf[i];
+  for(i=0; i<3; i++)
+    *hash = *hash*33 + data[i];
+  return 0;
+}
+
+
+/* Checks whether a queued frame at pos can be overwritten by buf */
+int compact_match(struct sendq *q, int pos, unsigned char *buf, int length) {
+  unsigned char data[4], frame[19];
+  int i;
+
+  /* must be within the queue and not partly transmitted, the first byte
+   * of a frame is the only one in the range 0x80 - 0xFE */
+  if((pos-q->start+q->size)%q->size+length > q->length)
+    return 1;
+  if(q->buf[pos] < 0x80 || q->buf[pos] == 0xFF || q->buf[(pos+length-1)%q->size] != 0xFF)
+    return 1;
+  for(i=0; i<19; i++)
+    frame[i] = q->buf[(pos+i)%q->size];
+  if(memcmp((void *)frame, (void *)buf, 9) != 0 || memcmp((void *)(frame+12), (void *)(buf+12), 3) != 0 || (frame[9]|frame[10]|frame[11]) != 0)
+    return 1;
+  for(i=15; i<19; i++)
+    if(frame[i] != buf[i])
+      break;
+  if(i == 19)
+    return 0;
+  /* the last of these bytes also holds some bits of the data type */
+  convert_7to8bits(frame+15, 4, data);
+  convert_7to8bits(buf+15, 4, frame);
+  return data[0] != frame[0] || data[1] != frame[1] || data[2] != frame[2];
+}
+
+
+/* Discards the oldest frame that hasn't been partly transmitted yet,
+ * returns 0 if there was such a frame */
+int drop_oldest(struct sendq *q) {
+  int off = 0, len, i;
+
+  /* skip over the partly transmitted frame */
+  if(q->partial) {
+    while(off < q->length && q->buf[(q->start+off)%q->size] != 0xFF)
+      off++;
+    off++;
+  }
+  if(off >= q->length)
+    return 1;
+
+  for(len=0; off+len < q->length && q->buf[(q->start+off+len)%q->size] != 0xFF; len++)
+    ;
+  len++;
+
+  /* move whatever is in front of it (at most one frame) over the dropped one */
+  for(i=off-1; i>=0; i--)
+    q->buf[(q->start+i+len)%q->size] = q->buf[(q->start+i)%q->size];
+  q->start = (q->start+len)%q->size;
+  q->length -= len;
+  q->frames--;
+  q->dropped++;
+  return 0;
+}
+
+
+/* Queues a frame, of which the first 'done' bytes have already been
+ * transmitted (only possible when the queue is empty) */
+int sendq_push(struct sendq *q, unsigned char *buf, int length, int done) {
+  unsigned long hash;
+  int i, end, pos, key = -1;
+
+  if(q->buf == NULL && (q->buf = (unsigned char *)malloc(q->size)) == NULL) {
+    q->dropped++;
+    return SENDQ_DROPPED;
+  }
+  if(q->index == NULL) {
+    q->indexsize = q->size/SENDQ_INDEXRATIO+1;
+    q->index = (int *)calloc(q->indexsize, sizeof(int));
+  }
+
+  /* last value wins: overwrite a queued frame of the same object */
+  if(!done && q->index != NULL && compact_key(buf, length, &hash) == 0) {
+    key = (int)(hash%q->indexsize);
+    pos = q->index[key]-1;
+    if(pos >= 0 && compact_match(q, pos, buf, length) == 0) {
+      for(i=0; i<length; i++)
+        q->buf[(pos+i)%q->size] = buf[i];
+      q->compacted++;
+      return SENDQ_QUEUED;
+    }
+  }
+  length -= done;
+
+  /* a partly transmitted frame must always be queued, or the stream gets corrupted */
+  if(!done) {
+    if(!q->congested && q->length+length > q->high)
+      q->congested = 1;
+    if(q->congested && q->policy == MBN_SLOWCONSUMER_DISCONNECT)
+      return SENDQ_DISCONNECT;
+    if(q->congested && q->policy == MBN_SLOWCONSUMER_COALESCE)
+      while(q->length+length > q->high && drop_oldest(q) == 0)
+        ;
+    if((q->congested && q->policy != MBN_SLOWCONSUMER_COALESCE) || q->length+length > q->size) {
+      q->dropped++;
+      return SENDQ_DROPPED;
+    }
+  }
+
+  end = (q->start+q->length)%q->size;
+  for(i=0; i<length; i++)
+    q->buf[(end+i)%q->size] = buf[done+i];
+  q->length += length;
+  q->frames++;
+  if(key >= 0)
+    q->index[key] = end+1;
+  if(done)
+    q->partial = 1;
+  if(q->length > q->peak)
+    q->peak = q->length;
+  return SENDQ_QUEUED;
+}
+
+
+/* Returns the number of bytes that can be transmitted in one go, and where they are */
+int sendq_peek(struct sendq *q, unsigned char **buf) {
+  *buf = q->buf+q->start;
+  return q->start+q->length > q->size ? q->size-q->start : q->length;
+}
+
+
+/* Removes transmitted bytes from the queue */
+void sendq_consume(struct sendq *q, int length) {
+  int i;
+
+  for(i=0; i<length; i++)
+    if(q->buf[(q->start+i)%q->size] == 0xFF) {
+      q->frames--;
+      q->sent++;
+    }
+  q->partial = q->buf[(q->start+length-1)%q->size] != 0xFF;
+  q->start = (q->start+length)%q->size;
+  q->length -= length;
+  if(q->congested && q->length <= q->low)
+    q->congested = 0;
+}
+
+
+void sendq_status(struct sendq *q, struct mbn_queue_status *status) {
+  status->Bytes = q->length;
+  status->Frames = q->frames;
+  status->Peak = q->peak;
+  status->Congested = q->congested;
+  status->Sent = q->sent;
+  status->Dropped = q->dropped;
+  status->Compacted = q->compacted;
+}
+
@@ -0,0 +1,55 @@
+/****************************************************************************
+**
+** Copyright (C) 2009 D&R Electronica Weesp B.V. All rights reserved.
+**
+** This file is part of the Axum/MambaNet digital mixing system.
+**
+** This file may be used under the terms of the GNU General Public
+** License version 2.0 as published by the Free Software Foundation
+** and appearing in the file LICENSE.GPL included in the packaging of
+** this file.
+**
+** This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+** WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+**
+****************************************************************************/
+
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include "mbn.h"
+
+#define SENDQ_INDEXRATIO 32 /* bytes of queue per index entry */
+
+/* return values of sendq_push() */
+#define SENDQ_QUEUED     0
+#define SENDQ_DROPPED    1
+#define SENDQ_DISCONNECT 2
+
+/* Ring buffer of outgoing MambaNet frames for a stream connection,
+ * the buffer itself is only allocated once something has to be queued */
+struct sendq {
+  unsigned char *buf;
+  int size, high, low;
+  int policy;
+  int start, length; /* bytes */
+  int frames;
+  char partial; /* first frame has already been partly transmitted */
+  char congested;
+  int peak;
+  unsigned long sent, dropped, compacted;
+  /* last queued position (+1) of compactable frames, by hash of their key */
+  int *index;
+  int indexsize;
+};
+
+void sendq_init(struct sendq *, struct mbn_if_config *);
+void sendq_clear(struct sendq *);
+void sendq_restart(struct sendq *);
+int sendq_push(struct sendq *, unsigned char *, int, int);
+int sendq_peek(struct sendq *, unsigned char **);
+void sendq_consume(struct sendq *, int);
+void sendq_status(struct sendq *, struct mbn_queue_status *);
+
+#endif
+